@@ -165,6 +165,8 @@
 
 #if (CPU_X86 || CPU_X64)
 #define pause() __builtin_ia32_pause()
+#else
+#define pause() atomic_signal_fence(memory_order_seq_cst)
 #endif
 
 #else
@@ -271,13 +273,19 @@ void spin_lock_init(lock_t* lock)
     atomic_flag_clear(&lock->value);
 }
 
-//TODO: Make fiber waiting spin lock after x amount of cycles
+/* Spins until the lock is free, use tc_mutex_t for locks that fibers can hold for a while */
 static inline
 void spin_lock(lock_t* lock)
 {
     while(atomic_flag_test_and_set_explicit(&lock->value, memory_order_acquire)) {}
 }
 
+static inline
+bool spin_try_lock(lock_t* lock)
+{
+    return !atomic_flag_test_and_set_explicit(&lock->value, memory_order_acquire);
+}
+
 static inline
 void spin_unlock(lock_t* lock)
 {
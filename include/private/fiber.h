@@ -16,11 +16,30 @@ typedef struct fiber_s fiber_t;
 typedef struct lock_s lock_t;
 typedef struct tc_allocator_i tc_allocator_i;
 
+/** Cancellation token that can be shared by the jobs of batches, graphs and continuations */
+typedef struct tc_cancel_s tc_cancel_t;
+
 /*
  * Jobs definition. 
 */
 typedef int64_t (*job_func)(void*);
 
+/** Jobs are taken from the critical queues first and the background queues last */
+typedef enum {
+	JOB_PRIORITY_NORMAL = 0,
+	JOB_PRIORITY_CRITICAL,
+	JOB_PRIORITY_BACKGROUND,
+	JOB_PRIORITY_COUNT
+} jobpriority_t;
+
+/** Stack size of the fiber a job runs on, small by default */
+typedef enum {
+	FIBER_STACK_SMALL = 0,		// 16 KiB
+	FIBER_STACK_MEDIUM,			// 64 KiB
+	FIBER_STACK_LARGE,			// 512 KiB, for deep call stacks like decompression or shader reflection
+	FIBER_STACK_COUNT
+} fiberstack_t;
+
 typedef struct {
 	/* 
 	 * Job function to be executed by a fiber 
@@ -30,15 +49,176 @@ typedef struct {
 	 * Context data pointer to give to job function	
 	 */
 	void* data;
+	/* 
+	 * Queue class of the job, normal by default
+	 */
+	jobpriority_t priority;
+	/* 
+	 * Stack size class of the fiber that runs the job, small by default
+	 */
+	fiberstack_t stack;
+	/* 
+	 * Optional cancellation token, the job is skipped when it is cancelled before it starts
+	 */
+	tc_cancel_t* cancel;
 
 } jobdecl_t;
 
+/** What to do when jobs are submitted while the job queues are full */
+typedef enum {
+	/* Keep queueing jobs in an unbounded overflow list */
+	BACKPRESSURE_SPILL = 0,
+	/* Run the job right away on a fiber of its stack class once max_spilled jobs are waiting, the submitting fiber goes back to the ready queue */
+	BACKPRESSURE_INLINE,
+	/* Yield the submitting fiber until max_spilled jobs are waiting */
+	BACKPRESSURE_YIELD,
+} backpressure_t;
+
+/** How worker threads are spread over the cpus */
+typedef enum {
+	/* One worker per logical cpu, SMT siblings each get a worker */
+	WORKER_PER_CPU = 0,
+	/* One worker per physical core, leaving SMT siblings to other threads. Cores with a reserved cpu get no worker */
+	WORKER_PER_CORE,
+} workerplacement_t;
+
+typedef struct {
+	/* 
+	 * Number of fibers to create per stack size class, these are kept when the pool shrinks
+	 */
+	uint32_t num_fibers[FIBER_STACK_COUNT];
+	/* 
+	 * Most fibers per stack size class the pool grows to when fibers are blocked, 0 for the default
+	 */
+	uint32_t max_fibers[FIBER_STACK_COUNT];
+	/* 
+	 * Policy for job submissions when the job queues are full
+	 */
+	backpressure_t backpressure;
+	/* 
+	 * Number of jobs that can overflow the job queues before backpressure is applied
+	 */
+	uint32_t max_spilled;
+	/* 
+	 * Whether workers are started per logical cpu or per physical core
+	 */
+	workerplacement_t placement;
+	/* 
+	 * Most worker threads to start, 0 for one per cpu or core that is not reserved
+	 */
+	uint32_t max_workers;
+	/* 
+	 * Logical cpus that no worker is placed on, for example for render or io threads.
+	 * With WORKER_PER_CORE the SMT siblings of these cpus are left free as well
+	 */
+	const uint32_t* reserved_cpus;
+	uint32_t num_reserved_cpus;
+
+} fiberpooldesc_t;
+
 /*==========================================================*/
 /*							FIBERS							*/
 /*==========================================================*/
 
 fut_t* tc_run_jobs(jobdecl_t* jobs, uint32_t num_jobs, int64_t* results);
 
+/** Processes the indices [begin, end) of a parallel loop */
+typedef void (*range_func)(void* ctx, size_t begin, size_t end);
+
+/**
+ * Runs func over the range [begin, end) using all workers with the priority of the calling job.
+ * The range starts as one job and is split in halves whenever other workers run out of work,
+ * but never into pieces smaller than grain. Passing a grain of 0 picks one based on the number of workers.
+ */
+fut_t* tc_parallel_for(size_t begin, size_t end, size_t grain, range_func func, void* ctx);
+
+/** Accumulates the indices [begin, end) into acc */
+typedef void (*reduce_func)(void* ctx, void* acc, size_t begin, size_t end);
+
+/** Combines the accumulator other into acc */
+typedef void (*combine_func)(void* ctx, void* acc, const void* other);
+
+typedef struct {
+	/* 
+	 * Range of indices to reduce
+	 */
+	size_t begin;
+	size_t end;
+	/* 
+	 * Smallest number of indices per job, 0 picks one based on the number of workers
+	 */
+	size_t grain;
+	/* 
+	 * Accumulates a range into a worker's partial accumulator, should not yield
+	 */
+	reduce_func func;
+	/* 
+	 * Combines two accumulators
+	 */
+	combine_func combine;
+	/* 
+	 * Initial value of each accumulator
+	 */
+	const void* identity;
+	/* 
+	 * Size of an accumulator in bytes
+	 */
+	size_t size;
+	/* 
+	 * Receives the combined accumulators, has to stay valid until the future completes
+	 */
+	void* result;
+	/* 
+	 * Context data pointer to give to func and combine
+	 */
+	void* ctx;
+
+} reducedesc_t;
+
+/**
+ * Parallel reduction over a range. Every worker accumulates into its own cache line padded copy
+ * of the identity, these are combined into result right before the future completes.
+ */
+fut_t* tc_parallel_reduce(const reducedesc_t* desc);
+
+/**
+ * Task graphs are a fixed set of jobs with dependencies between them that can be ran many times.
+ * A node is queued as soon as all its dependencies are finished, so no fiber waits on another node.
+ */
+typedef struct tc_graph_s tc_graph_t;
+
+/** Creates an empty task graph */
+tc_graph_t* tc_graph_new(tc_allocator_i* a);
+
+/** Adds a node that runs job and returns its index */
+uint32_t tc_graph_add(tc_graph_t* g, jobdecl_t job);
+
+/** Makes node wait for dependency to finish before it starts */
+void tc_graph_depend(tc_graph_t* g, uint32_t node, uint32_t dependency);
+
+/** Prepares the graph for running, has to be called again after adding nodes or dependencies */
+void tc_graph_compile(tc_graph_t* g);
+
+/**
+ * Starts all nodes of a compiled graph. The future completes when every node is done,
+ * results is an optional array that receives the result of each node.
+ * The optional cancel token is used for every node instead of the token of the node itself.
+ * The graph can not be changed or destroyed until the future completes.
+ */
+fut_t* tc_graph_run(tc_graph_t* g, int64_t* results, tc_cancel_t* cancel);
+
+/** Destroys a task graph */
+void tc_graph_destroy(tc_graph_t* g);
+
+/**
+ * Queues job once fut reaches zero without blocking a fiber, fut is freed when the job starts.
+ * The job can read the result of fut with tc_job_input. Returns the future of the job so continuations can be chained.
+ */
+fut_t* tc_fut_then(fut_t* fut, jobdecl_t job);
+
+/** Result of the future that the running continuation job waited for, 0 for other jobs */
+int64_t tc_job_input();
+
 /** Returns the currently executing fiber */
 fiber_t* tc_fiber();
 
@@ -57,11 +237,24 @@ void tc_fiber_yield(lock_t* lk);
 /** Resume executing a fiber (that was suspended) */
 void tc_fiber_resume(fiber_t* f);
 
-/** Allocate from fiber local scratch buffer which gets dumped at the end of fiber lifetime */
+/** Position in the scratch buffer of the current fiber */
+typedef struct {
+	void* chunk;
+	void* ptr;
+	void* large;
+} scratchmark_t;
+
+/** Allocate from fiber local scratch buffer which gets rewound when the job of the fiber finishes */
 void* tc_scratch_alloc(size_t size);
 
-/** Initializes the fiber pool with `num_fibers` fibers */
-void fiber_pool_init(tc_allocator_i* a, uint32_t num_fibers);
+/** Remembers the position in the scratch buffer of the current fiber */
+scratchmark_t tc_scratch_mark();
+
+/** Releases everything allocated from the scratch buffer of the current fiber since the mark was taken */
+void tc_scratch_rewind(scratchmark_t mark);
+
+/** Initializes the fiber pool and starts a worker thread per cpu */
+void fiber_pool_init(tc_allocator_i* a, const fiberpooldesc_t* desc);
 
 /** Destroys the fiber pool */
 void fiber_pool_destroy(tc_allocator_i* a);
@@ -73,6 +266,8 @@ void fiber_pool_destroy(tc_allocator_i* a);
 
 /** Waitable object interface associated with a counter */
 #define TC_NOT_FINISHED 0xdfffffff
+/** Result of jobs that were skipped because their token was cancelled, futures with a skipped job keep this result */
+#define TC_CANCELLED 0xdffffffe
 
 typedef struct {
 	/** The waitable object that will be freed */
@@ -88,8 +283,8 @@ typedef struct {
 /** Waits for a counter to complete and free the counter automatically */
 #define await(_c) tc_fut_wait_and_free((_c), 0)
 
-/** Gets a new atomic counter from the counter pool and assigns a value to it */
-fut_t* tc_fut_new(tc_allocator_i* a, size_t value, tc_waitable_i* w, uint32_t num_slots);
+/** Gets a new atomic counter from the counter pool and assigns a value to it. Any number of fibers can wait on it */
+fut_t* tc_fut_new(tc_allocator_i* a, size_t value, tc_waitable_i* w);
 
 /** Increments atomic counter and resumes fibers that wait on the new value */
 size_t tc_fut_incr(fut_t* c);
@@ -97,23 +292,58 @@ size_t tc_fut_incr(fut_t* c);
 /** Decrements atomic counter and resumes fibers that wait on the new value */
 size_t tc_fut_decr(fut_t* c);
 
-/** Waits for a counter to become a specific value. Puts the currently executing fiber in a wait list in the background */
+/**
+ * Waits for a counter to become a specific value. Puts the currently executing fiber in a wait list in the background.
+ * Threads outside the fiber pool run queued jobs while they wait, or block when all guest slots are in use.
+ */
 int64_t tc_fut_wait(fut_t* c, size_t value);
 
 /** Frees the counter when it is not used anymore and calls the destructor on the waitable */
 void tc_fut_free(fut_t* c);
 
+/**
+ * Waits until one of the futures reaches value and returns its index, the futures are not freed.
+ * Add a future from tc_timer_start to the list to wait with a deadline.
+ * Threads outside the fiber pool wait the same way as in tc_fut_wait.
+ */
+uint32_t tc_fut_wait_any(fut_t** futs, uint32_t count, size_t value);
+
 /** First wait for the counter to reach a number and then free the counter */
 int64_t tc_fut_wait_and_free(fut_t* c, size_t value);
 
 
+/*==========================================================*/
+/*						CANCELLATION						*/
+/*==========================================================*/
+
+/**
+ * Creates a cancellation token. Jobs that carry it are skipped when they are dequeued after
+ * it got cancelled and their futures complete with TC_CANCELLED.
+ * The token cancels itself after timeout miliseconds if timeout is nonzero.
+ */
+tc_cancel_t* tc_cancel_new(tc_allocator_i* a, uint64_t timeout);
+
+/** Cancels all jobs that carry the token and did not start yet, running jobs can poll it */
+void tc_cancel(tc_cancel_t* token);
+
+/** Whether the token was cancelled or its deadline passed, false for NULL */
+bool tc_cancel_requested(tc_cancel_t* token);
+
+/** Whether the token of the currently running job was cancelled, long running jobs can poll this to stop early */
+bool tc_job_cancelled();
+
+/** Frees a token, it has to outlive the futures of all jobs that carry it */
+void tc_cancel_free(tc_cancel_t* token);
+
+
 /*==========================================================*/
 /*							TIMERS							*/
 /*==========================================================*/
 
 /**
  * Starts a timer that decreases a counter after timeout miliseconds.
- * Repeats the counter tick repeat number of times if it is nonzero
+ * Repeats the counter tick repeat number of times if it is nonzero.
+ * Timeouts are rounded up to the timer wheel tick of a few miliseconds, freeing the counter cancels the timer.
  */
 fut_t* tc_timer_start(uint64_t timeout, uint64_t repeats);
 
@@ -124,21 +354,139 @@ fut_t* tc_timer_start(uint64_t timeout, uint64_t repeats);
 
 typedef struct tc_channel_s tc_channel_t;
 
+/** How a channel synchronizes its senders and receivers */
+typedef enum {
+	/* Ring buffer behind a spinlock, values are handed over directly to waiting fibers */
+	CHANNEL_LOCKED = 0,
+	/* Lock free ring for any number of senders and receivers, the lock is only taken when the channel is full or empty */
+	CHANNEL_MPMC,
+	/* Lock free ring for one sending and one receiving fiber at a time */
+	CHANNEL_SPSC,
+} channelmode_t;
+
 typedef struct {
 	tc_channel_t* channel;
 	void* value;
 } tc_put_t;
 
+/** Receives a value on the calling fiber, waiting while the channel is empty. Returns false once the channel is closed and empty */
+bool tc_chan_recv(tc_channel_t* channel, void** value);
+
+/** Sends a value on the calling fiber, waiting while the channel is full. Returns false when the channel is closed */
+bool tc_chan_send(tc_channel_t* channel, void* value);
+
+/**
+ * Sends count values, waiting whenever the channel is full. Values are moved in batches
+ * under a single reservation and waiting receivers are woken once per batch.
+ * Returns the number of values sent, which is less than count when the channel was closed.
+ */
+uint32_t tc_chan_send_n(tc_channel_t* channel, void* const* values, uint32_t count);
+
+/**
+ * Waits for at least one value and receives up to count values in one batch.
+ * Returns the number of values received, 0 when the channel is closed.
+ */
+uint32_t tc_chan_recv_n(tc_channel_t* channel, void** values, uint32_t count);
+
+/**
+ * Receives a value from the first of the channels that has one, waiting while all are empty.
+ * Returns the index of the channel that was received from, or -1 when all channels are closed.
+ */
+int tc_chan_select(tc_channel_t** channels, uint32_t count, void** value);
+
+/** Starts a job that receives a value, the result of the future is the value */
 fut_t* tc_chan_get(tc_channel_t* channel);
 
 bool tc_chan_try_get(tc_channel_t* channel, void** value);
 
+/** Starts a job that sends a value */
 fut_t* tc_chan_put(tc_put_t* put_data);
 
 bool tc_chan_try_put(tc_put_t* put_data);
 
 void tc_chan_close(tc_channel_t* channel);
 
-tc_channel_t* tc_chan_new(tc_allocator_i* a, uint32_t size);
+/** Creates a channel that holds size values, lock free modes round size up to a power of two */
+tc_channel_t* tc_chan_new(tc_allocator_i* a, uint32_t size, channelmode_t mode);
 
 void tc_chan_destroy(tc_channel_t* channel);
+
+
+/*==========================================================*/
+/*						SYNCHRONIZATION						*/
+/*==========================================================*/
+
+/*
+ * Locks for fibers. They spin for a short while and then put the fiber in a wait list
+ * so the worker can run other fibers, unlike lock_t which keeps spinning.
+ * They can only be used from fibers running on worker threads.
+ */
+
+typedef struct tc_syncwaiter_s tc_syncwaiter_t;
+
+typedef struct {
+	tc_syncwaiter_t* head;
+	tc_syncwaiter_t* tail;
+} tc_waitlist_t;
+
+typedef struct {
+	// 0 when unlocked, 1 when locked and 2 when locked with fibers waiting
+	atomic_t state;
+	lock_t guard;
+	tc_waitlist_t waiters;
+} tc_mutex_t;
+
+typedef struct {
+	// Number of readers, plus flags for a writer holding it and fibers waiting
+	atomic_t state;
+	lock_t guard;
+	tc_waitlist_t readers;
+	tc_waitlist_t writers;
+} tc_rwlock_t;
+
+typedef struct {
+	atomic_t count;
+	atomic_t num_waiting;
+	lock_t guard;
+	tc_waitlist_t waiters;
+} tc_sem_t;
+
+typedef struct {
+	lock_t guard;
+	tc_waitlist_t waiters;
+} tc_cond_t;
+
+void tc_mutex_init(tc_mutex_t* m);
+
+void tc_mutex_lock(tc_mutex_t* m);
+
+bool tc_mutex_try_lock(tc_mutex_t* m);
+
+/** Unlocks the mutex, a waiting fiber gets the lock handed over directly */
+void tc_mutex_unlock(tc_mutex_t* m);
+
+void tc_rwlock_init(tc_rwlock_t* rw);
+
+/** Locks for reading, new readers wait when a writer is waiting so writers can not starve */
+void tc_rwlock_read_lock(tc_rwlock_t* rw);
+
+void tc_rwlock_read_unlock(tc_rwlock_t* rw);
+
+void tc_rwlock_write_lock(tc_rwlock_t* rw);
+
+void tc_rwlock_write_unlock(tc_rwlock_t* rw);
+
+void tc_sem_init(tc_sem_t* s, size_t count);
+
+void tc_sem_wait(tc_sem_t* s);
+
+void tc_sem_post(tc_sem_t* s);
+
+void tc_cond_init(tc_cond_t* c);
+
+/** Unlocks the mutex and waits for a signal, the mutex is locked again before returning */
+void tc_cond_wait(tc_cond_t* c, tc_mutex_t* m);
+
+void tc_cond_signal(tc_cond_t* c);
+
+void tc_cond_broadcast(tc_cond_t* c);
@@ -225,7 +225,10 @@ void* temp_realloc(tc_temp_t* a, void* ptr, size_t old_size, size_t new_size, co
 	temp_internal_t* temp = (temp_internal_t*)a->buffer;
 	if (new_size > old_size) {
 		if (temp->used + new_size > temp->cap) {
-			size_t size = min(CHUNK_SIZE, next_power_of_2((uint32_t)(new_size + sizeof(temp_node_t))));
+			// Nodes are at least a chunk and always big enough for the allocation
+			size_t size = next_power_of_2((uint32_t)(new_size + sizeof(temp_node_t)));
+			if (size < CHUNK_SIZE)
+				size = CHUNK_SIZE;
 			temp_node_t* node = TC_ALLOC(a->parent, size);
 			node->size = size;
 			node->next = a->next;
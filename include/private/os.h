@@ -46,6 +46,25 @@ typedef struct stat_s {
     bool is_dir;
 } stat_t;
 
+typedef struct cpuinfo_s {
+    /* 
+     * Logical cpu number as used by os_set_thread_affinity
+     */
+    uint32_t id;
+    /* 
+     * Physical core within the package, SMT siblings share the same core
+     */
+    uint32_t core;
+    /* 
+     * Processor package (socket) the core is in
+     */
+    uint32_t package;
+    /* 
+     * NUMA node the cpu belongs to
+     */
+    uint32_t node;
+} cpuinfo_t;
+
 
 void* os_map(size_t size);
 
@@ -55,6 +74,9 @@ void* os_reserve(size_t size);
 
 void os_commit(void* p, size_t size);
 
+/* Releases the physical memory of committed pages, the address range stays reserved */
+void os_decommit(void* p, size_t size);
+
 size_t os_page_size();
 
 void os_guard_page(void* ptr, size_t size);
@@ -100,6 +122,9 @@ uint32_t os_cpu_id();
 
 uint32_t os_num_cpus();
 
+/** Fills cpus with up to max logical cpus this process may run on and returns the number found */
+uint32_t os_cpu_topology(cpuinfo_t* cpus, uint32_t max);
+
 tc_thread_t os_create_thread(tc_thread_f entry, void* data, uint32_t stack_size);
 
 tc_thread_t os_current_thread();
@@ -7,15 +7,16 @@ tc_allocator_i* a;
 static void* producer(void* args) {
 	tc_channel_t* c = (tc_channel_t*)args;
 	int wid = os_cpu_id();
-	tc_put_t data = { c, wid };
 	TRACE(LOG_INFO, "%i, produced", os_cpu_id());
-	await(tc_chan_put(&data));
+	tc_chan_send(c, (void*)(intptr_t)wid);
 	return 0;
 }
 
 static void* consumer(void* args) {
 	tc_channel_t* c = (tc_channel_t*)args;
-	int data = await(tc_chan_get(c));
+	void* value = NULL;
+	tc_chan_recv(c, &value);
+	int data = (int)(intptr_t)value;
 	TRACE(LOG_INFO, "%i, %i consumed", os_cpu_id(), data);
 	return 0;
 }
@@ -28,7 +29,7 @@ static void* test2(void* args) {
 
 static void* test(void* args) {
 	int64_t* b = (int64_t*)args;
-	jobdecl_t jobs[64];
+	jobdecl_t jobs[64] = { 0 };
 	for (int i = 0; i < 64; i++) {
 		jobs[i].func = test2;
 		jobs[i].data = *b + i;
@@ -38,6 +39,28 @@ static void* test(void* args) {
 	return 0;
 }
 
+static int64_t select_sender(void* args) {
+	tc_chan_send((tc_channel_t*)args, (void*)(intptr_t)42);
+	return 0;
+}
+
+/* Selecting over a closed and an empty channel waits for a value on the open one */
+static int64_t select_closed(void* args) {
+	const channelmode_t modes[] = { CHANNEL_LOCKED, CHANNEL_MPMC };
+	for (int i = 0; i < TC_COUNT(modes); i++) {
+		tc_channel_t* channels[2] = { tc_chan_new(a, 1, modes[i]), tc_chan_new(a, 1, modes[i]) };
+		tc_chan_close(channels[0]);
+		fut_t* sent = tc_run_jobs(&(jobdecl_t){ .func = select_sender, .data = channels[1] }, 1, NULL);
+		void* value = NULL;
+		int index = tc_chan_select(channels, 2, &value);
+		TC_ASSERT(index == 1 && (intptr_t)value == 42);
+		tc_fut_wait_and_free(sent, 0);
+		tc_chan_destroy(channels[0]);
+		tc_chan_destroy(channels[1]);
+	}
+	return 0;
+}
+
 tc_window_t window;
 swapchain_t swapchain;
 renderer_t renderer;
@@ -168,7 +191,7 @@ int main(void) {
 	a = tc_buddy_new(tc_mem->vm, GLOBAL_BUFFER_SIZE, 64);
 
 	registry_init();
-	fiber_pool_init(a, 256);
+	fiber_pool_init(a, &(fiberpooldesc_t){ .num_fibers = { 256, 128, 16 } });
 
 	fs_set_resource_dir(&systemfs, M_CONTENT, R_SHADER_SOURCES, "..\\..\\shaders");
 	fs_set_resource_dir(&systemfs, M_CONTENT, R_SHADER_BINARIES, "..\\..\\compiledshaders");
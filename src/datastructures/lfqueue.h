@@ -45,7 +45,7 @@ static inline bool lf_queue_put(lf_queue_t* queue, void* data) {
 		size_t seq = (size_t)atomic_load(&cell->sequence);
 		intptr_t dif = (intptr_t)seq - (intptr_t)pos;
 		if (dif == 0) {
-			if (CAS(&queue->write, &pos, pos + 1)) {
+			if (CAS(&queue->write, pos, pos + 1)) {
 				break;
 			}
 		}
@@ -69,7 +69,7 @@ static inline bool lf_queue_get(lf_queue_t* queue, void** data) {
 		size_t seq = (size_t)atomic_load(&cell->sequence);
 		intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
 		if (dif == 0) {
-			if (CAS(&queue->read, &pos, pos + 1)) {
+			if (CAS(&queue->read, pos, pos + 1)) {
 				break;
 			}
 		}
@@ -85,6 +85,73 @@ static inline bool lf_queue_get(lf_queue_t* queue, void** data) {
 	return true;
 }
 
+/*
+ * Puts up to count elements with a single reservation, returns the number that fit.
+ * Only cells that readers are done with are reserved, so a stalled reader shortens the batch instead of blocking it.
+ */
+static inline size_t lf_queue_put_n(lf_queue_t* queue, void* const* data, size_t count) {
+	size_t pos = atomic_load_explicit(&queue->write, memory_order_relaxed);
+	size_t n;
+	for (;;) {
+		n = 0;
+		while (n < count && (size_t)atomic_load(&queue->buffer[(pos + n) & queue->mask].sequence) == pos + n) {
+			n++;
+		}
+		if (n == 0) {
+			size_t seq = (size_t)atomic_load(&queue->buffer[pos & queue->mask].sequence);
+			if ((intptr_t)seq - (intptr_t)pos < 0) {
+				return 0;
+			}
+			pos = atomic_load_explicit(&queue->write, memory_order_relaxed);
+		}
+		else if (CAS(&queue->write, pos, pos + n)) {
+			break;
+		}
+	}
+	for (size_t i = 0; i < n; i++) {
+		cell_t* cell = &queue->buffer[(pos + i) & queue->mask];
+		cell->data = data[i];
+		atomic_store_explicit(&cell->sequence, pos + i + 1, memory_order_release);
+	}
+	return n;
+}
+
+/*
+ * Gets up to count elements with a single reservation, returns the number taken.
+ * Only cells that writers published are reserved, so a stalled writer shortens the batch instead of blocking it.
+ */
+static inline size_t lf_queue_get_n(lf_queue_t* queue, void** data, size_t count) {
+	size_t pos = atomic_load_explicit(&queue->read, memory_order_relaxed);
+	size_t n;
+	for (;;) {
+		n = 0;
+		while (n < count && (size_t)atomic_load(&queue->buffer[(pos + n) & queue->mask].sequence) == pos + n + 1) {
+			n++;
+		}
+		if (n == 0) {
+			size_t seq = (size_t)atomic_load(&queue->buffer[pos & queue->mask].sequence);
+			if ((intptr_t)seq - (intptr_t)(pos + 1) < 0) {
+				return 0;
+			}
+			pos = atomic_load_explicit(&queue->read, memory_order_relaxed);
+		}
+		else if (CAS(&queue->read, pos, pos + n)) {
+			break;
+		}
+	}
+	for (size_t i = 0; i < n; i++) {
+		cell_t* cell = &queue->buffer[(pos + i) & queue->mask];
+		data[i] = cell->data;
+		atomic_store_explicit(&cell->sequence, pos + i + queue->mask + 1, memory_order_release);
+	}
+	return n;
+}
+
+static inline bool lf_queue_is_empty(lf_queue_t* queue) {
+	size_t read = atomic_load_explicit(&queue->read, memory_order_relaxed);
+	return atomic_load_explicit(&queue->write, memory_order_relaxed) == read;
+}
+
 static inline void lf_queue_destroy(lf_queue_t* queue) {
 	TC_FREE(queue->base, queue, sizeof(lf_queue_t) + ((queue->mask + 1) * sizeof(cell_t)));
 }
\ No newline at end of file
@@ -0,0 +1,108 @@
+/*==========================================================*/
+/*				SINGLE PRODUCER/CONSUMER QUEUE				*/
+/*==========================================================*/
+#pragma once
+#include "tc.h"
+
+
+/*
+ * Fixed-size (FIFO) ring buffer for exactly one writing and one reading thread at a time.
+ * Both sides keep a cached copy of the other side's index so they only touch its cache line when the cache is stale.
+ */
+
+typedef struct spsc_queue_s {
+	tc_allocator_i* base;
+	size_t mask;
+	void** buffer;
+	ALIGNED(atomic_t, 64) write;
+	size_t read_cache;
+	ALIGNED(atomic_t, 64) read;
+	size_t write_cache;
+} spsc_queue_t;
+
+
+static inline spsc_queue_t* spsc_queue_init(uint32_t elements, tc_allocator_i* allocator) {
+	spsc_queue_t* queue = (spsc_queue_t*)TC_ALLOC(allocator, sizeof(spsc_queue_t) + elements * sizeof(void*));
+	queue->base = allocator;
+	queue->buffer = (void**)(queue + 1);
+	queue->mask = elements - 1;
+	TC_ASSERT((elements >= 2) && ((elements & (elements - 1)) == 0));
+	queue->read_cache = 0;
+	queue->write_cache = 0;
+	atomic_store_explicit(&queue->write, 0, memory_order_relaxed);
+	atomic_store_explicit(&queue->read, 0, memory_order_relaxed);
+	return queue;
+}
+
+/* Only to be called by the producer */
+static inline bool spsc_queue_put(spsc_queue_t* queue, void* data) {
+	size_t pos = atomic_load_explicit(&queue->write, memory_order_relaxed);
+	if (pos - queue->read_cache > queue->mask) {
+		queue->read_cache = atomic_load_explicit(&queue->read, memory_order_acquire);
+		if (pos - queue->read_cache > queue->mask) {
+			return false;
+		}
+	}
+	queue->buffer[pos & queue->mask] = data;
+	atomic_store_explicit(&queue->write, pos + 1, memory_order_release);
+	return true;
+}
+
+/* Only to be called by the consumer */
+static inline bool spsc_queue_get(spsc_queue_t* queue, void** data) {
+	size_t pos = atomic_load_explicit(&queue->read, memory_order_relaxed);
+	if (pos == queue->write_cache) {
+		queue->write_cache = atomic_load_explicit(&queue->write, memory_order_acquire);
+		if (pos == queue->write_cache) {
+			return false;
+		}
+	}
+	*data = queue->buffer[pos & queue->mask];
+	atomic_store_explicit(&queue->read, pos + 1, memory_order_release);
+	return true;
+}
+
+/* Only to be called by the producer, returns the number of elements that fit */
+static inline size_t spsc_queue_put_n(spsc_queue_t* queue, void* const* data, size_t count) {
+	size_t pos = atomic_load_explicit(&queue->write, memory_order_relaxed);
+	size_t n = queue->mask + 1 - (pos - queue->read_cache);
+	if (n < count) {
+		queue->read_cache = atomic_load_explicit(&queue->read, memory_order_acquire);
+		n = queue->mask + 1 - (pos - queue->read_cache);
+	}
+	if (n > count) {
+		n = count;
+	}
+	for (size_t i = 0; i < n; i++) {
+		queue->buffer[(pos + i) & queue->mask] = data[i];
+	}
+	atomic_store_explicit(&queue->write, pos + n, memory_order_release);
+	return n;
+}
+
+/* Only to be called by the consumer, returns the number of elements taken */
+static inline size_t spsc_queue_get_n(spsc_queue_t* queue, void** data, size_t count) {
+	size_t pos = atomic_load_explicit(&queue->read, memory_order_relaxed);
+	size_t n = queue->write_cache - pos;
+	if (n < count) {
+		queue->write_cache = atomic_load_explicit(&queue->write, memory_order_acquire);
+		n = queue->write_cache - pos;
+	}
+	if (n > count) {
+		n = count;
+	}
+	for (size_t i = 0; i < n; i++) {
+		data[i] = queue->buffer[(pos + i) & queue->mask];
+	}
+	atomic_store_explicit(&queue->read, pos + n, memory_order_release);
+	return n;
+}
+
+static inline bool spsc_queue_is_empty(spsc_queue_t* queue) {
+	size_t read = atomic_load_explicit(&queue->read, memory_order_relaxed);
+	return atomic_load_explicit(&queue->write, memory_order_relaxed) == read;
+}
+
+static inline void spsc_queue_destroy(spsc_queue_t* queue) {
+	TC_FREE(queue->base, queue, sizeof(spsc_queue_t) + ((queue->mask + 1) * sizeof(void*)));
+}
@@ -0,0 +1,114 @@
+/*==========================================================*/
+/*					WORK-STEALING DEQUE						*/
+/*==========================================================*/
+#pragma once
+#include "tc.h"
+
+
+/*
+ * Fixed-size Chase-Lev deque. The owning thread pushes and pops at the bottom (LIFO)
+ * while any other thread can steal from the top (FIFO). Pushing fails when the deque is full.
+ */
+
+typedef struct ws_deque_s {
+	tc_allocator_i* base;
+	size_t mask;
+	ALIGNED(atomic_t*, 64) buffer;
+	ALIGNED(atomic_t, 64) top;
+	ALIGNED(atomic_t, 64) bottom;
+} ws_deque_t;
+
+
+static inline ws_deque_t* ws_deque_init(uint32_t elements, tc_allocator_i* allocator) {
+	ws_deque_t* deque = (ws_deque_t*)TC_ALLOC(allocator, sizeof(ws_deque_t) + elements * sizeof(atomic_t));
+	deque->base = allocator;
+	deque->buffer = (atomic_t*)(deque + 1);
+	deque->mask = elements - 1;
+	TC_ASSERT((elements >= 2) && ((elements & (elements - 1)) == 0));
+	for (size_t i = 0; i != elements; i++) {
+		atomic_store_explicit(&deque->buffer[i], 0, memory_order_relaxed);
+	}
+	atomic_store_explicit(&deque->top, 0, memory_order_relaxed);
+	atomic_store_explicit(&deque->bottom, 0, memory_order_relaxed);
+	return deque;
+}
+
+/* Only to be called by the owner of the deque */
+static inline bool ws_deque_push(ws_deque_t* deque, void* data) {
+	size_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+	size_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+	if ((intptr_t)(b - t) > (intptr_t)deque->mask) {
+		return false;
+	}
+	atomic_store_explicit(&deque->buffer[b & deque->mask], (size_t)data, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+	return true;
+}
+
+/* Pushes up to count elements with a single update of bottom, returns the number pushed. Only to be called by the owner of the deque */
+static inline size_t ws_deque_push_n(ws_deque_t* deque, void* const* data, size_t count) {
+	size_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+	size_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+	if ((intptr_t)(b - t) > (intptr_t)deque->mask) {
+		return 0;
+	}
+	size_t n = deque->mask + 1 - (b - t);
+	if (n > count) {
+		n = count;
+	}
+	for (size_t i = 0; i < n; i++) {
+		atomic_store_explicit(&deque->buffer[(b + i) & deque->mask], (size_t)data[i], memory_order_relaxed);
+	}
+	// Thieves see all elements at once
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&deque->bottom, b + n, memory_order_relaxed);
+	return n;
+}
+
+/* Only to be called by the owner of the deque */
+static inline bool ws_deque_pop(ws_deque_t* deque, void** data) {
+	size_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	size_t t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+	if ((intptr_t)t > (intptr_t)b) {
+		// Deque was empty, restore bottom
+		atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+		return false;
+	}
+	*data = (void*)atomic_load_explicit(&deque->buffer[b & deque->mask], memory_order_relaxed);
+	if (t == b) {
+		// Last element, race against thieves for it
+		bool won = atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+		atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+		return won;
+	}
+	return true;
+}
+
+/* Can be called by any thread */
+static inline bool ws_deque_steal(ws_deque_t* deque, void** data) {
+	size_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	size_t b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+	if ((intptr_t)t >= (intptr_t)b) {
+		return false;
+	}
+	void* value = (void*)atomic_load_explicit(&deque->buffer[t & deque->mask], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+		return false;
+	}
+	*data = value;
+	return true;
+}
+
+static inline bool ws_deque_is_empty(ws_deque_t* deque) {
+	size_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+	size_t t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+	return (intptr_t)t >= (intptr_t)b;
+}
+
+static inline void ws_deque_destroy(ws_deque_t* deque) {
+	TC_FREE(deque->base, deque, sizeof(ws_deque_t) + ((deque->mask + 1) * sizeof(atomic_t)));
+}
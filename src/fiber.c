@@ -4,23 +4,59 @@
 #include "private_types.h"
 #include "datastructures/lfqueue.h"
 #include "datastructures/lflifo.h"
+#include "datastructures/wsdeque.h"
+#include "datastructures/spscqueue.h"
 #include "datastructures/list.h"
 
 #include <fcontext/fcontext.h>
 #include <uv.h>
 
 enum {
-	FIBER_STACK_SIZE = SLAB_MIN_SIZE,			// Default fiber stack size in bytes
+	FIBER_STACK_SIZE = SLAB_MIN_SIZE,			// Alignment of fibers and size of worker allocations in bytes
 	FIBER_NUM_JOBS = 8192,						// Maximum number of jobs in the queue
-	FIBER_MAIN_ID = -1,
+	FIBER_DEQUE_SIZE = 4096,					// Maximum number of jobs in a worker's local deque
+	FIBER_SPLIT_FACTOR = 8,						// Number of grains per worker when picking a grain size
+	FIBER_CACHE_LINE = 64,						// Padding between per worker data
+	FIBER_STARVATION_LIMIT = 32,				// Number of jobs after which background jobs get a turn
+	FIBER_SPIN_MIN = 16,						// Least number of empty polls before an idle worker parks
+	FIBER_SPIN_MAX = 4096,						// Most number of empty polls before an idle worker parks
+	FIBER_PARK_SHORT = 50000,					// Parks shorter than this (in ns) make workers spin longer
+	FIBER_TRIM_DELAY = 1000,					// Time (in ms) without fibers finishing before extra stacks are released
+	FIBER_REQUEST_CLASSES = 7,					// Number of recycled job request sizes, powers of two up to 64 jobs
+	FIBER_MAGAZINE_SIZE = 64,					// Most recycled objects a worker keeps per size class
+	FIBER_GUEST_SLOTS = 4,						// Number of threads outside the pool that can run jobs while they wait
+	FIBER_SCRATCH_CHUNK = 4096,					// Size of the first scratch chunk of a fiber, later chunks double in size
+	FIBER_SCRATCH_LARGE = 64 * 1024,			// Scratch allocations bigger than this get their own allocation
+	FIBER_SCRATCH_KEEP = 256 * 1024,			// Most scratch memory a fiber keeps between jobs
+	FIBER_SCRATCH_ALIGN = 16,					// Alignment of scratch allocations
+	FIBER_PUSH_BATCH = 256,						// Most jobs of a batch that are queued with one reservation
+	FIBER_WAKE_BATCH = 16,						// Most fibers a batched channel operation wakes per lock
+	FIBER_WAIT_ANY_MAX = 64,					// Most futures or channels a single wait any or select can wait on
+	FIBER_WAIT_ANY_INLINE = 8,					// Waiters of a wait any or select kept on the stack, more are allocated
+	FIBER_SYNC_SPIN = 64,						// Number of tries before a fiber waits for a mutex, rwlock or semaphore
+	FIBER_TIMER_TICK = 4,						// Timer resolution (in ms), timers expiring in the same tick fire together
+	FIBER_TIMER_BITS = 6,						// Number of bits of the tick that each wheel level covers
+	FIBER_TIMER_SLOTS = 1 << FIBER_TIMER_BITS,	// Number of slots in every level of the timer wheel
+	FIBER_TIMER_LEVELS = 4,						// Number of levels in the timer wheel, covers about 18 hours
 };
 
 #define FIBER_NAME_LEN 64
 
-typedef struct {
+// Node of guest slots, the threads that use them can run on any node
+#define FIBER_NODE_ANY UINT32_MAX
+
+struct job_s;
+
+typedef struct jobrequest_s {
 	tc_waitable_i;
 	size_t num_jobs;
 	int64_t* result_ptr;
+	// Optional callback that is ran by the last job before the future completes
+	void (*complete)(struct jobrequest_s* req);
+	// Jobs that did not finish yet, only counted for requests with a complete callback
+	atomic_t outstanding;
+	// Optional callback that is ran instead of a job that got cancelled
+	void (*skip)(struct job_s* job);
 } jobrequest_t;
 
 typedef struct ALIGNED(job_s, 64) {
@@ -29,36 +65,138 @@ typedef struct ALIGNED(job_s, 64) {
 	fut_t* future;
 	uint32_t id;
 	jobrequest_t* req;
+	// Next job in the overflow list when the queues are full
+	struct job_s* next;
+	// Queue class of this job
+	jobpriority_t priority;
+	// Stack size class of the fiber this job runs on
+	fiberstack_t stack;
+	// Optional token, the job is skipped when it is cancelled before it starts
+	tc_cancel_t* cancel;
 } job_t;
 
+typedef struct scratchchunk_s {
+	struct scratchchunk_s* next;
+	// Size including this header
+	size_t size;
+} scratchchunk_t;
+
+typedef struct {
+	// Chunk that is allocated from, it links to the chunks that were filled before it
+	scratchchunk_t* chunk;
+	char* ptr;
+	char* end;
+	// Rewound chunks that are used again before allocating new ones
+	scratchchunk_t* spare;
+	// Allocations too big for a chunk, freed when rewound
+	scratchchunk_t* large;
+} scratch_t;
+
 typedef struct fiber_s {
 	// Intrusive list node for recyclable fibers or waiting fibers
 	lf_lifo_t state;							
 	// Coroutine context
 	fcontext_t fctx;							
-	// Fiber id
+	// Fiber id, 0 for scheduler fibers that are pinned to their worker
 	int id;										
+	// Worker this fiber last ran on, where it is resumed after waiting
+	int worker;
 	// Job to be ran when starting this fiber
 	atomic_t job;									
 	// Start of the fiber's stack
 	char* stack_ptr;							
 	// Size of fiber stack
 	uint32_t stack_size;						
-	// Fiber scratch allocator that gets cleared when fiber is finished
-	tc_temp_t temp;
+	// Stack size class, the pool this fiber is returned to
+	fiberstack_t stack_class;
+	// Set while the fiber finishes its job or is about to block, fibers it wakes then are not offered to other workers
+	bool blocking;
+	// Fiber scratch arena that is rewound when a job finishes, its memory is kept for the next job
+	scratch_t scratch;
 	// Name of fiber for debug purposes
 	char name[FIBER_NAME_LEN];
 
 } fiber_t;
 
-typedef struct {
+typedef enum {
+	TIMER_PENDING,								// Waiting in a slot of the wheel
+	TIMER_FIRING,								// Taken out of the wheel while its future is decremented
+	TIMER_DONE,									// Fired for the last time
+	TIMER_CANCELLED,							// Future was freed while firing, the firing worker frees the timer
+} timerstate_t;
+
+typedef struct fibertimer_s {
 	tc_waitable_i;
-	slab_obj_t;
-	uv_timer_t handle;
+	// Timers in the same wheel slot, prev points to the link pointing at this timer for O(1) cancelling
+	struct fibertimer_s* next;
+	struct fibertimer_s** prev;
 	fut_t* future;
-	uint64_t timeout;
+	// Tick at which the timer fires next
+	uint64_t expires;
+	// Ticks between repeats
+	uint64_t interval;
 	uint64_t repeats;
-} timer_t;
+	timerstate_t state;
+	// Worker that owns the wheel this timer is in
+	int worker;
+} fibertimer_t;
+
+typedef struct {
+	// Timers per level and slot, every level covers FIBER_TIMER_SLOTS times the ticks of the level below
+	fibertimer_t* slots[FIBER_TIMER_LEVELS][FIBER_TIMER_SLOTS];
+	// Last tick that was processed
+	uint64_t now;
+	// Tick the event loop timer goes off, UINT64_MAX when it is stopped
+	uint64_t armed;
+	// Number of timers in the wheel
+	uint32_t count;
+	// Set when a guest thread added a timer, the owner sets the event loop timer again
+	bool rearm;
+	// Timers are only added and fired by the owning worker but can be cancelled from any worker
+	lock_t lock;
+	// Wakes up the worker when the next slot is due
+	uv_timer_t handle;
+} timerwheel_t;
+
+typedef struct recycled_s {
+	struct recycled_s* next;
+} recycled_t;
+
+typedef struct {
+	// Freed objects of one size that are handed out again before going to the allocator
+	recycled_t* head;
+	uint32_t count;
+} magazine_t;
+
+typedef struct {
+	// Lock free singly linked list of free fibers
+	ALIGNED(lf_lifo_t, 64) free_list;
+	// Free fibers whose stack was released, only used when no fiber in the free list is left
+	lf_lifo_t cold_list;
+	// Number of fibers that were taken from the reserved address space
+	ALIGNED(atomic_t, 64) num_created;
+	// Number of fibers that have their stack committed
+	atomic_t num_committed;
+	// Time (in ms) the last fiber of this class finished
+	atomic_t last_free;
+	// Taken by the worker that releases the stacks of idle fibers
+	lock_t trim_lock;
+	// Address space reserved for all fibers of this class
+	char* region;
+	size_t reserved;
+	// First 64k aligned fiber in the reserved region
+	char* base;
+	// Bytes between fibers, a multiple of 64k so fibers can be put in lock free lists
+	size_t stride;
+	// Usable stack size of every fiber in this class
+	uint32_t stack_size;
+	// Number of fibers that stay committed when the pool shrinks
+	uint32_t num_fibers;
+	// Number of fibers the address space is reserved for
+	uint32_t max_fibers;
+	// Id of the first fiber in this class
+	uint32_t first_id;
+} fiberclass_t;
 
 typedef struct {
 	fiber_t sched;
@@ -68,39 +206,85 @@ typedef struct {
 	tc_thread_t tid;
 	// Optional fiber context lock which is unlocked 
 	lock_t* fiblk;
+	// Optional fiber that is put back in the ready queue once it switched out
+	fiber_t* requeue;
+	// Optional fiber that finished and is put back in the pool once it switched out
+	fiber_t* finished;
+	// Fiber woken by the running fiber, it is switched to directly when the running fiber blocks or finishes
+	atomic_t handoff;
+	// Fibers that are done waiting and last ran on this worker, idle workers steal from here
+	lf_lifo_t ready;
+	// Fibers that can only be resumed by this worker
+	lf_lifo_t pinned;
 	// Event loop that handles io between fiber executions
 	uv_loop_t loop;
+	// Wakes up the event loop when the worker is parked
+	uv_async_t wakeup;
+	// Timers started on this worker
+	timerwheel_t wheel;
+	// Set while the worker is (about to be) parked in its event loop
+	atomic_t parked;
+	// Set while a thread outside the pool uses this guest slot to run jobs while it waits
+	atomic_t guest;
+	// Number of empty polls since the worker last found something to do
+	uint32_t idle;
+	// Stack class + 1 of a job that was put back because no fiber was free, 0 when there is none
+	uint32_t stalled;
+	// Number of empty polls before parking, adapts to how long parks last
+	uint32_t spin;
+	// Jobs submitted by this worker per priority, other workers steal from the top
+	ws_deque_t* deque[JOB_PRIORITY_COUNT];
+	// State for picking random steal victims
+	uint32_t seed;
+	// Number of jobs ran since the last time background jobs were checked
+	uint32_t starvation;
+	// Recycled futures, timers and job requests per size class, only touched by this worker
+	magazine_t futures;
+	magazine_t timers;
+	magazine_t requests[FIBER_REQUEST_CLASSES];
 	// Id of this worker
 	int id;
+	// Logical cpu the worker thread is pinned to and its numa node, guest slots use FIBER_NODE_ANY
+	uint32_t cpu;
+	uint32_t node;
 	// Name of worker thread for debug purposes
 	char name[FIBER_NAME_LEN];
 } worker_t;
 
 typedef struct {
 	// Initialization and destruction synchronization
-	uv_sem_t sem;								
+	uv_sem_t sem;
+	// Released once every worker is set up so no worker steals from one that is not
+	uv_sem_t start;
+	// Address space of all worker slots, each touched first by the thread that runs it
+	char* worker_region;								
 	// Array with worker threads
 	worker_t** workers;
 	// Number of worker threads
 	size_t num_cords;
+	// Number of worker slots, the worker threads followed by the guest slots
+	size_t num_workers;
 	// Pointer to the main thread
 	worker_t* main;
-	// These fibers are done waiting
-	ALIGNED(lf_lifo_t, 64) ready;				
-	// Lock free singly linked list of free fibers
-	ALIGNED(lf_lifo_t, 64) free_list;			
-	// Cords take jobs from this queue
-	ALIGNED(lf_queue_t*, 64) job_queue;		
-	// Array of allocated fiber stacks for fiber allocation
-	fiber_t** fibers;						
-	// Number of fiber stacks
-	size_t num_fibers;
+	// Jobs submitted from non-worker threads or that did not fit in a worker deque
+	ALIGNED(lf_queue_t*, 64) job_queue[JOB_PRIORITY_COUNT];
+	// Unbounded overflow lists for jobs that did not fit in the job queue
+	ALIGNED(lock_t, 64) spill_lock;
+	job_t* spill_head[JOB_PRIORITY_COUNT];
+	job_t* spill_tail[JOB_PRIORITY_COUNT];
+	atomic_t num_spilled[JOB_PRIORITY_COUNT];
+	// Number of workers that are parked
+	ALIGNED(atomic_t, 64) num_parked;
+	// Number of workers waiting for a fiber to start a job they put back
+	atomic_t num_stalled;
+	// What to do when the job queues are full
+	backpressure_t backpressure;
+	// Number of spilled jobs allowed before backpressure is applied
+	size_t max_spilled;
+	// Fiber pools per stack size class
+	fiberclass_t classes[FIBER_STACK_COUNT];
 	// Base allocator for fibers
 	tc_allocator_i* a;
-	
-	timer_t* timer_pool;
-
-	lock_t timer_pool_lock;
 
 } fiber_context_t;
 
@@ -110,23 +294,53 @@ static fiber_context_t* context = NULL;
 
 ALIGNED(THREAD_LOCAL worker_t*, 64) local_cord;
 
-static jobdecl_t* job_next();
+static job_t* job_next(worker_t* c);
+
+static void job_push(job_t* job);
+
+static void job_push_n(job_t* jobs, uint32_t count);
+
+static void job_requeue(worker_t* c, job_t* job);
 
 static void job_destroy(jobrequest_t* req);
 
+/** Frees the futures, timers and job requests a worker kept for reuse */
+static void job_clear_recycled(worker_t* c);
+
 static void job_finish(job_t* job, int64_t result);
 
-/** Gets a new fiber from the fiber pool */
-static fiber_t* fiber_create(const char* name);
+/** Finishes the job as cancelled instead of running it when its token was cancelled */
+static bool job_skip(job_t* job);
+
+/** Job running on the current fiber or NULL */
+static job_t* job_current();
+
+/** Gets a new fiber from the fiber pool with at least the stack size of the class */
+static fiber_t* fiber_create(const char* name, fiberstack_t stack);
 
-static void fiber_init(fiber_t* fiber, uint32_t id, fiber_func func);
+static void fiber_init(fiber_t* fiber, uint32_t id, uint32_t stack_size, fiber_func func);
 
 /** Starts a job in a fiber and switches to that fiber */
-static void fiber_start(fiber_t* f, const jobdecl_t* job);
+static void fiber_start(fiber_t* f, job_t* job);
 
 /** Destroys a fiber and places it back into the pool */
 static void fiber_destroy(fiber_t* f);
 
+/** Releases the stacks of fibers that were not needed for a while */
+static void fiber_trim(worker_t* c);
+
+static void fiber_switched(fcontext_transfer_t t);
+
+static void fiber_handoff(fiber_t* f);
+
+/** Sets up the timer wheel of a worker */
+static void timer_wheel_init(worker_t* c);
+
+#ifndef NDEBUG
+/** Checks that timers expiring on the last tick of a block of a higher level fire on their own tick */
+static void timer_wheel_check();
+#endif
+
 
 /*==========================================================*/
 /*						WORKER THREADS						*/
@@ -136,33 +350,226 @@ static void fiber_destroy(fiber_t* f);
 
 static worker_t* worker() { return local_cord; }
 
+static void* magazine_pop(magazine_t* m)
+{
+	recycled_t* r = m->head;
+	if (r) {
+		m->head = r->next;
+		m->count--;
+	}
+	return r;
+}
+
+/** Keeps a freed object for reuse, returns false when the magazine is full */
+static bool magazine_push(magazine_t* m, void* p)
+{
+	if (m->count >= FIBER_MAGAZINE_SIZE)
+		return false;
+	recycled_t* r = p;
+	r->next = m->head;
+	m->head = r;
+	m->count++;
+	return true;
+}
+
+static void magazine_clear(magazine_t* m, size_t size)
+{
+	void* p;
+	while ((p = magazine_pop(m)))
+		TC_FREE(context->a, p, size);
+}
+
+static uint32_t worker_rand(worker_t* c)
+{
+	// Xorshift, only used for spreading steal attempts over workers
+	uint32_t x = c->seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	c->seed = x;
+	return x;
+}
+
 void* tc_eventloop() { return &worker()->loop; }
 
+/** Sets the event loop timer again when another thread added a timer to our wheel */
+static void timer_rearm(worker_t* c);
+
+static void worker_wakeup_cb(uv_async_t* handle) { timer_rearm((worker_t*)handle->data); }
+
+/** Wakes up a worker if it is parked */
+static bool worker_wake(worker_t* c)
+{
+	size_t expected = 1;
+	if (atomic_compare_exchange_strong(&c->parked, &expected, 0)) {
+		uv_async_send(&c->wakeup);
+		return true;
+	}
+	return false;
+}
+
+/** Wakes up one parked worker, if any, after new work was made available */
+static void worker_wake_any()
+{
+	// Pairs with the fence in worker_park so either we see the parked worker or it sees the work
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&context->num_parked, memory_order_relaxed) == 0)
+		return;
+	worker_t* self = worker();
+	size_t n = context->num_workers;
+	size_t start = self ? worker_rand(self) % n : 0;
+	for (size_t i = 0; i < n; i++) {
+		if (worker_wake(context->workers[(start + i) % n]))
+			return;
+	}
+}
+
+static bool worker_has_work(worker_t* c)
+{
+	if (!lf_lifo_is_empty(&c->pinned))
+		return true;
+	for (size_t i = 0; i < context->num_workers; i++) {
+		if (!lf_lifo_is_empty(&context->workers[i]->ready) || atomic_load(&context->workers[i]->handoff))
+			return true;
+	}
+	for (int p = 0; p < JOB_PRIORITY_COUNT; p++) {
+		if (!lf_queue_is_empty(context->job_queue[p]) || atomic_load(&context->num_spilled[p]))
+			return true;
+		for (size_t i = 0; i < context->num_workers; i++) {
+			if (!ws_deque_is_empty(context->workers[i]->deque[p]))
+				return true;
+		}
+	}
+	return false;
+}
+
+/** Whether a fiber with at least the stack size of the class is free */
+static bool worker_fiber_free(fiberstack_t stack)
+{
+	for (int i = stack; i < FIBER_STACK_COUNT; i++) {
+		if (!lf_lifo_is_empty(&context->classes[i].free_list) || !lf_lifo_is_empty(&context->classes[i].cold_list))
+			return true;
+	}
+	return false;
+}
+
+/** Sleeps in the event loop until io completes or another thread wakes us up */
+static void worker_park(worker_t* c)
+{
+	atomic_store(&c->parked, 1);
+	atomic_fetch_add(&context->num_parked, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	// Check again after announcing we are parked so work submitted in between is not missed,
+	// a worker that put back a job only waits for a fiber to start it with
+	uint64_t start = uv_hrtime();
+	bool ready = c->stalled ? worker_fiber_free(c->stalled - 1) : worker_has_work(c);
+	if (!ready)
+		uv_run(&c->loop, UV_RUN_ONCE);
+	if (c->stalled) {
+		c->stalled = 0;
+		atomic_fetch_sub(&context->num_stalled, 1);
+	}
+	atomic_store(&c->parked, 0);
+	atomic_fetch_sub(&context->num_parked, 1);
+	// Spin longer when work came in right after parking, shorter when it took a while
+	if (uv_hrtime() - start < FIBER_PARK_SHORT)
+		c->spin = c->spin * 2 > FIBER_SPIN_MAX ? FIBER_SPIN_MAX : c->spin * 2;
+	else
+		c->spin = c->spin / 2 < FIBER_SPIN_MIN ? FIBER_SPIN_MIN : c->spin / 2;
+}
+
+static void worker_idle(worker_t* c)
+{
+	// Spin for a while first, work tends to arrive in bursts
+	if (c->idle++ < c->spin) {
+		pause();
+		return;
+	}
+	c->idle = 0;
+	fiber_trim(c);
+	worker_park(c);
+}
+
+/** Whether to try stealing from a victim in this pass, workers on our own numa node go first */
+static bool worker_steal_from(worker_t* c, worker_t* victim, int pass)
+{
+	return victim != c && (victim->node == c->node) == (pass == 0);
+}
+
+/** Takes a waiting fiber from another worker when we have nothing else to do */
+static fiber_t* fiber_steal(worker_t* c)
+{
+	size_t n = context->num_workers;
+	size_t start = worker_rand(c) % n;
+	for (int pass = 0; pass < 2; pass++) {
+		for (size_t i = 0; i < n; i++) {
+			worker_t* victim = context->workers[(start + i) % n];
+			if (!worker_steal_from(c, victim, pass))
+				continue;
+			fiber_t* f = lf_lifo_is_empty(&victim->ready) ? NULL : lf_lifo_pop(&victim->ready);
+			// The victim is busy running the fiber that woke this one
+			if (!f && atomic_load_explicit(&victim->handoff, memory_order_relaxed))
+				f = (fiber_t*)atomic_exchange(&victim->handoff, 0);
+			if (f)
+				return f;
+		}
+	}
+	return NULL;
+}
+
+static void worker_run_fiber(fiber_t* f)
+{
+	lf_lifo_init(&f->state);
+	tc_fiber_resume(f);
+}
+
 static void worker_loop(worker_t* c) {
-	jobdecl_t* job = NULL;
+	job_t* job = NULL;
 	fiber_t* f;
 	for (;;) {
-		f = lf_lifo_pop(&context->ready);
-		if (f) { // Dont finish sched fiber in non sched owned thread
+		bool idle = true;
+		// Only our own scheduler fiber is pinned here, resuming it means returning from the loop
+		f = lf_lifo_pop(&c->pinned);
+		if (f) {
+			TC_ASSERT(f == &c->sched);
 			lf_lifo_init(&f->state);
-			if (f == &c->sched) return;
-			else if (f->id == 0 || (f->id == FIBER_MAIN_ID && c->id != 1))
-				lf_lifo_push(&context->ready, f);
+			return;
+		}
+		// Fibers that ran here before are resumed first, their data is still in our caches
+		f = lf_lifo_pop(&c->ready);
+		if (f) {
+			idle = false;
+			worker_run_fiber(f);
+		}
+		// Cancelled jobs finish right away without taking a fiber
+		while ((job = job_next(c)) && job_skip(job))
+			idle = false;
+		if (job) {
+			f = fiber_create("worker", job->stack);
+			if (f) {
+				idle = false;
+				TC_ASSERT(f->job == NULL);
+				fiber_start(f, job);
+			}
 			else {
-				tc_fiber_resume(f);
-				if (f->job == NULL) fiber_destroy(f);
+				// All stacks big enough are in use, park until a fiber finishes instead of taking the job again right away
+				job_requeue(c, job);
+				c->stalled = job->stack + 1;
+				atomic_fetch_add(&context->num_stalled, 1);
 			}
 		}
-		job = job_next();
-		if (job) {
-			f = fiber_create("worker");
-			TC_ASSERT(f && f->job == NULL);
-			fiber_start(f, job);
-			// If fiber is done we can put it on the free stack
-			if (f->job == NULL)
-				fiber_destroy(f);
+		// Waiting fibers do not need a new stack, so we can still resume those while stalled
+		if ((!job || c->stalled) && (f = fiber_steal(c))) {
+			idle = false;
+			worker_run_fiber(f);
 		}
 		uv_run(&c->loop, UV_RUN_NOWAIT);
+		if (c->stalled)
+			worker_park(c);
+		else if (idle)
+			worker_idle(c);
+		else
+			c->idle = 0;
 	}
 }
 
@@ -170,23 +577,83 @@ struct worker_args {
 	worker_t* worker;
 	const char* name;
 	int id;
+	cpuinfo_t cpu;
 };
 
+/** Sets up the scheduling fiber and event loop of a worker or guest slot */
+static void worker_setup(worker_t* c, const char* name, int id) {
+	// First touch of the slot, its pages end up on the numa node of the calling thread
+	memset(c, 0, FIBER_STACK_SIZE);
+	for (int j = 0; j < JOB_PRIORITY_COUNT; j++)
+		c->deque[j] = ws_deque_init(FIBER_DEQUE_SIZE, tc_mem->vm);
+	c->node = FIBER_NODE_ANY;
+	c->id = id;
+	c->seed = 2654435761u * (id + 1);
+	sprintf(&c->name, name, id);
+	// Initialize scheduling fiber
+	fiber_init(&c->sched, 0, 0, NULL);
+	c->sched.worker = c->id;
+	strcpy(&c->sched.name, "sched");
+	c->curr_fiber = &c->sched;
+	c->spin = FIBER_SPIN_MIN;
+
+	uv_loop_init(&c->loop);
+	uv_async_init(&c->loop, &c->wakeup, worker_wakeup_cb);
+	c->wakeup.data = c;
+	timer_wheel_init(c);
+}
+
 static void worker_init(struct worker_args* args) {
 	worker_t* c = args->worker;
+	// Assign thread to cpu before the worker memory is touched so it is allocated on the node of the cpu
+	os_set_thread_affinity(os_current_thread(), args->cpu.id);
+	worker_setup(c, args->name, args->id);
 	local_cord = c;
-	c->id = args->id;
-	sprintf(&c->name, args->name, args->id);
-	// Initialize thread id and assign thread to cpu
 	c->tid = os_current_thread();
+	c->cpu = args->cpu.id;
+	c->node = args->cpu.node;
+}
 
-	os_set_thread_affinity(c->tid, args->id);
-	// Initialize scheduling fiber
-	fiber_create(&c->sched, 0, NULL);
-	strcpy(&c->sched.name, "sched");
-	c->curr_fiber = &c->sched;
+/** Lends a guest slot to a thread outside the pool so it can run jobs while it waits, returns NULL when all are taken */
+static worker_t* guest_enter()
+{
+	for (size_t i = context->num_cords; i < context->num_workers; i++) {
+		worker_t* c = context->workers[i];
+		size_t expected = 0;
+		if (atomic_load_explicit(&c->guest, memory_order_relaxed) == 0 &&
+			atomic_compare_exchange_strong(&c->guest, &expected, 1)) {
+			c->tid = os_current_thread();
+			local_cord = c;
+			return c;
+		}
+	}
+	return NULL;
+}
 
-	uv_loop_init(&c->loop);
+static void guest_leave(worker_t* c)
+{
+	TC_ASSERT(c->curr_fiber == &c->sched);
+	// Jobs that ran here started io on the loop of this slot, nobody runs it after we leave so finish it first
+	uv_unref((uv_handle_t*)&c->wakeup);
+	uv_unref((uv_handle_t*)&c->wheel.handle);
+	while (uv_loop_alive(&c->loop))
+		uv_run(&c->loop, UV_RUN_ONCE);
+	uv_ref((uv_handle_t*)&c->wakeup);
+	uv_ref((uv_handle_t*)&c->wheel.handle);
+	local_cord = NULL;
+	atomic_store(&c->guest, 0);
+	// Fibers and jobs left in the slot are stolen by the worker threads, pairs with the check in tc_fiber_ready
+	bool left = !lf_lifo_is_empty(&c->ready);
+	for (int p = 0; p < JOB_PRIORITY_COUNT; p++)
+		left |= !ws_deque_is_empty(c->deque[p]);
+	if (left)
+		worker_wake_any();
+}
+
+static void worker_exit(worker_t* c) {
+	uv_close((uv_handle_t*)&c->wakeup, NULL);
+	uv_close((uv_handle_t*)&c->wheel.handle, NULL);
+	uv_run(&c->loop, UV_RUN_NOWAIT);
 }
 
 static void worker_entry(void* arg) {
@@ -195,8 +662,10 @@ static void worker_entry(void* arg) {
 	// Signal thread init is done
 	worker_t* c = args->worker;
 	uv_sem_post(&context->sem);
+	uv_sem_wait(&context->start);
 	// Start looping to run fibers
 	tc_fiber_yield(NULL);
+	worker_exit(c);
 	// Signal thread is finished
 	uv_sem_post(&context->sem);
 }
@@ -209,14 +678,120 @@ static void worker_entry(void* arg) {
 
 fiber_t* tc_fiber() { return worker()->curr_fiber; }
 
-void* tc_scratch_alloc(size_t size) { return TC_ALLOC(&tc_fiber()->temp, size);}
+static void scratch_rewind(scratch_t* s, scratchchunk_t* chunk, char* ptr, scratchchunk_t* large)
+{
+	while (s->large != large) {
+		scratchchunk_t* l = s->large;
+		s->large = l->next;
+		TC_FREE(context->a, l, l->size);
+	}
+	while (s->chunk != chunk) {
+		scratchchunk_t* c = s->chunk;
+		s->chunk = c->next;
+		c->next = s->spare;
+		s->spare = c;
+	}
+	s->ptr = ptr;
+	s->end = chunk ? (char*)chunk + chunk->size : NULL;
+}
+
+/** Rewinds the arena after a job and keeps a single chunk big enough for what the job used */
+static void scratch_reset(scratch_t* s)
+{
+	scratch_rewind(s, NULL, NULL, NULL);
+	if (!s->spare || (!s->spare->next && s->spare->size <= FIBER_SCRATCH_KEEP))
+		return;
+	size_t total = 0;
+	while (s->spare) {
+		scratchchunk_t* c = s->spare;
+		s->spare = c->next;
+		total += c->size;
+		TC_FREE(context->a, c, c->size);
+	}
+	size_t size = FIBER_SCRATCH_CHUNK;
+	while (size < total && size < FIBER_SCRATCH_KEEP)
+		size *= 2;
+	s->spare = TC_ALLOC(context->a, size);
+	s->spare->size = size;
+	s->spare->next = NULL;
+}
+
+/** Frees all scratch memory of a fiber that is not used */
+static void scratch_release(scratch_t* s)
+{
+	scratch_rewind(s, NULL, NULL, NULL);
+	while (s->spare) {
+		scratchchunk_t* c = s->spare;
+		s->spare = c->next;
+		TC_FREE(context->a, c, c->size);
+	}
+}
+
+static void scratch_grow(scratch_t* s, size_t size)
+{
+	// Use a rewound chunk first
+	scratchchunk_t** prev = &s->spare;
+	scratchchunk_t* c;
+	while ((c = *prev) && c->size - sizeof(scratchchunk_t) < size)
+		prev = &c->next;
+	if (c)
+		*prev = c->next;
+	else {
+		// Chunks grow geometrically so jobs that need a lot of scratch only allocate a few times
+		size_t chunk = s->chunk ? s->chunk->size * 2 : FIBER_SCRATCH_CHUNK;
+		while (chunk - sizeof(scratchchunk_t) < size)
+			chunk *= 2;
+		c = TC_ALLOC(context->a, chunk);
+		c->size = chunk;
+	}
+	c->next = s->chunk;
+	s->chunk = c;
+	s->ptr = (char*)(c + 1);
+	s->end = (char*)c + c->size;
+}
+
+void* tc_scratch_alloc(size_t size)
+{
+	scratch_t* s = &tc_fiber()->scratch;
+	size = (size + FIBER_SCRATCH_ALIGN - 1) & ~(size_t)(FIBER_SCRATCH_ALIGN - 1);
+	if (size > FIBER_SCRATCH_LARGE) {
+		// Big allocations would waste most of a chunk, they are freed on rewind
+		scratchchunk_t* l = TC_ALLOC(context->a, sizeof(scratchchunk_t) + size);
+		l->size = sizeof(scratchchunk_t) + size;
+		l->next = s->large;
+		s->large = l;
+		return l + 1;
+	}
+	if ((size_t)(s->end - s->ptr) < size)
+		scratch_grow(s, size);
+	void* p = s->ptr;
+	s->ptr += size;
+	return p;
+}
+
+scratchmark_t tc_scratch_mark()
+{
+	scratch_t* s = &tc_fiber()->scratch;
+	return (scratchmark_t){ s->chunk, s->ptr, s->large };
+}
+
+void tc_scratch_rewind(scratchmark_t mark)
+{
+	scratch_rewind(&tc_fiber()->scratch, mark.chunk, mark.ptr, mark.large);
+}
 
 void tc_fiber_ready(fiber_t* f)
 {
 	TC_ASSERT(f->id == 0 || f->job != NULL);
-	TC_ASSERT(lf_lifo(atomic_load(&context->ready.next)) != f);
+	// Resume the fiber on the worker it last ran on, scheduler fibers can only run there
+	worker_t* c = context->workers[f->worker];
+	lf_lifo_t* list = f->id == 0 ? &c->pinned : &c->ready;
+	TC_ASSERT(lf_lifo(atomic_load(&list->next)) != f);
 	lf_lifo_init(&f->state);
-	lf_lifo_push(&context->ready, &f->state);
+	lf_lifo_push(list, &f->state);
+	// The owner is busy, or it is a guest slot or the main thread that does not park, another worker steals the fiber
+	if (!worker_wake(c) && f->id != 0)
+		worker_wake_any();
 }
 
 static void fiber_loop(fcontext_transfer_t t)
@@ -225,142 +800,386 @@ static void fiber_loop(fcontext_transfer_t t)
 	TC_ASSERT(f);
 	TC_ASSERT(t.ctx != NULL);
 	t = jump_fcontext(t.ctx, NULL);
-	worker()->sched.fctx = t.ctx;
+	fiber_switched(t);
 	for (;;) {
 		TC_ASSERT(f != NULL && f->job != NULL && f->id != 0);
-		tc_temp_init(&f->temp, context->a);
 		job_t* job = (job_t*)f->job;
 		int64_t ret = job->func(job->data);
+		// Fibers waiting for this job take over our worker once we switch out
+		f->blocking = true;
 		job_finish(job, ret);
+		f->blocking = false;
 		// Clear fiber local 
-		tc_temp_free(&f->temp);
+		scratch_reset(&f->scratch);
 		f->name[0] = '\0';
 		atomic_store(&f->job, 0);
+		// Put back in the pool by the next fiber once we switched out
+		worker()->finished = f;
 		tc_fiber_yield(NULL);		// Back to the scheduler
 	}
 }
 
-void fiber_pool_init(tc_allocator_i* a, uint32_t num_fibers)
+static const uint32_t fiber_stack_sizes[FIBER_STACK_COUNT] = { 16 * 1024, 64 * 1024, 512 * 1024 };
+
+static const uint32_t fiber_max_fibers[FIBER_STACK_COUNT] = { 16384, 4096, 512 };
+
+/** Commits the stack of a fiber and sets up its context */
+static void fiber_commit(fiber_t* f)
+{
+	fiberclass_t* cls = &context->classes[f->stack_class];
+	// Only the pages that are used get committed, stacks are not touched until they run
+	os_commit((char*)f + CHUNK_SIZE, 2 * CHUNK_SIZE + cls->stack_size);
+	fiber_init(f, f->id, cls->stack_size, fiber_loop);
+	atomic_fetch_add(&cls->num_committed, 1);
+}
+
+/** Releases the stack of a free fiber, its context is set up again when it is reused */
+static void fiber_decommit(fiber_t* f)
+{
+	fiberclass_t* cls = &context->classes[f->stack_class];
+	os_decommit((char*)f + 2 * CHUNK_SIZE, cls->stack_size);
+	scratch_release(&f->scratch);
+	f->fctx = NULL;
+	atomic_fetch_sub(&cls->num_committed, 1);
+}
+
+/** Takes a new fiber from the reserved address space of a class */
+static fiber_t* fiber_grow(fiberstack_t stack)
+{
+	fiberclass_t* cls = &context->classes[stack];
+	size_t n = atomic_load(&cls->num_created);
+	do {
+		if (n >= cls->max_fibers)
+			return NULL;
+	} while (!CAS(&cls->num_created, n, n + 1));
+	fiber_t* f = (fiber_t*)(cls->base + n * cls->stride);
+	os_commit(f, CHUNK_SIZE);
+	memset(f, 0, sizeof(fiber_t));
+	f->id = cls->first_id + (uint32_t)n;
+	f->stack_class = stack;
+	fiber_commit(f);
+	return f;
+}
+
+static void fiber_class_init(fiberstack_t stack, uint32_t num_fibers, uint32_t max_fibers, uint32_t first_id)
+{
+	fiberclass_t* cls = &context->classes[stack];
+	lf_lifo_init(&cls->free_list);
+	lf_lifo_init(&cls->cold_list);
+	spin_lock_init(&cls->trim_lock);
+	cls->stack_size = fiber_stack_sizes[stack];
+	// Header, guard page, stack and another guard page rounded up to the fiber alignment
+	cls->stride = (3 * CHUNK_SIZE + cls->stack_size + FIBER_STACK_SIZE - 1) & ~((size_t)FIBER_STACK_SIZE - 1);
+	cls->num_fibers = num_fibers;
+	cls->max_fibers = max_fibers;
+	cls->first_id = first_id;
+	if (max_fibers == 0)
+		return;
+	// Address space for every fiber is reserved up front, memory is only committed when a fiber is needed
+	cls->reserved = ((size_t)max_fibers + 1) * cls->stride;
+	cls->region = os_reserve(cls->reserved);
+	TC_ASSERT(cls->region);
+	cls->base = (char*)(((size_t)cls->region + FIBER_STACK_SIZE - 1) & ~((size_t)FIBER_STACK_SIZE - 1));
+	for (uint32_t i = 0; i < num_fibers; i++) {
+		fiber_t* f = fiber_grow(stack);
+		TC_ASSERT(f);
+		// Add fiber to free list
+		lf_lifo_push(&cls->free_list, &f->state);
+	}
+}
+
+static int cpu_compare(const void* a, const void* b)
+{
+	const cpuinfo_t* x = a;
+	const cpuinfo_t* y = b;
+	if (x->node != y->node)
+		return x->node < y->node ? -1 : 1;
+	if (x->package != y->package)
+		return x->package < y->package ? -1 : 1;
+	if (x->core != y->core)
+		return x->core < y->core ? -1 : 1;
+	return x->id < y->id ? -1 : x->id > y->id;
+}
+
+/** Keeps the cpus that get a worker at the front, workers on the same node end up next to each other */
+static bool cpu_reserved(const fiberpooldesc_t* desc, uint32_t id)
+{
+	for (uint32_t j = 0; j < desc->num_reserved_cpus; j++) {
+		if (desc->reserved_cpus[j] == id)
+			return true;
+	}
+	return false;
+}
+
+static uint32_t worker_place(const fiberpooldesc_t* desc, cpuinfo_t* cpus, uint32_t num_cpus)
+{
+	qsort(cpus, num_cpus, sizeof(cpuinfo_t), cpu_compare);
+	uint32_t n = 0;
+	for (uint32_t i = 0; i < num_cpus;) {
+		// Cpus are sorted by core so the siblings of a core follow each other
+		uint32_t end = i + 1;
+		if (desc->placement == WORKER_PER_CORE) {
+			while (end < num_cpus && cpus[end].core == cpus[i].core && cpus[end].package == cpus[i].package)
+				end++;
+		}
+		// A core with a reserved cpu gets no worker, its siblings would compete with the reserved thread
+		bool skip = false;
+		for (uint32_t k = i; k < end && !skip; k++)
+			skip = cpu_reserved(desc, cpus[k].id);
+		// Only the first sibling of a core is kept
+		if (!skip)
+			cpus[n++] = cpus[i];
+		i = end;
+	}
+	if (n == 0) {
+		TRACE(LOG_WARNING, "[Thread]: All cpus are reserved, starting a single worker.");
+		n = 1;
+	}
+	if (desc->max_workers && n > desc->max_workers)
+		n = desc->max_workers;
+	return n;
+}
+
+void fiber_pool_init(tc_allocator_i* a, const fiberpooldesc_t* desc)
 {
 	TC_ASSERT(sizeof(fiber_t) <= CHUNK_SIZE);
+#ifndef NDEBUG
+	timer_wheel_check();
+#endif
 	
-	uint32_t num_cords = os_num_cpus();
-
 	context = TC_ALLOC(a, sizeof(fiber_context_t));
 	memset(context, 0, sizeof(fiber_context_t));
 	context->a = a;
 	
 	// Initialize job queue for schedulers
-	context->job_queue = lf_queue_init(FIBER_NUM_JOBS, a);  // Allocate job queue
-
-	// Create other reusable fibers
-	context->fibers = TC_ALLOC(a, num_fibers * sizeof(fiber_t*));
-	TC_ASSERT(context->fibers);
-	context->num_fibers = num_fibers;
-	lf_lifo_init(&context->free_list);
-	for (int i = 0; i < num_fibers; i++) {
-		context->fibers[i] = TC_ALLOC(a, FIBER_STACK_SIZE);
-		TC_ASSERT(((size_t)context->fibers[i] & ~0xffff) == (size_t)context->fibers[i]);
-		memset(context->fibers[i], 0, FIBER_STACK_SIZE);
-		fiber_init(context->fibers[i], i + 1, fiber_loop);
-		// Add fiber to free list
-		lf_lifo_push(&context->free_list, &context->fibers[i]->state);
+	for (int i = 0; i < JOB_PRIORITY_COUNT; i++)
+		context->job_queue[i] = lf_queue_init(FIBER_NUM_JOBS, a);  // Allocate job queue
+	spin_lock_init(&context->spill_lock);
+	context->backpressure = desc->backpressure;
+	context->max_spilled = desc->max_spilled;
+
+	// Create reusable fibers for every stack size class, ids start at 1
+	uint32_t first_id = 1;
+	for (int i = 0; i < FIBER_STACK_COUNT; i++) {
+		uint32_t max_fibers = desc->max_fibers[i] ? desc->max_fibers[i] : fiber_max_fibers[i];
+		if (max_fibers < desc->num_fibers[i])
+			max_fibers = desc->num_fibers[i];
+		fiber_class_init(i, desc->num_fibers[i], max_fibers, first_id);
+		first_id += max_fibers;
+	}
+
+	// Pick the cpus to run workers on
+	uint32_t num_cpus = os_num_cpus();
+	cpuinfo_t* cpus = TC_ALLOC(a, num_cpus * sizeof(cpuinfo_t));
+	uint32_t num_cords = worker_place(desc, cpus, os_cpu_topology(cpus, num_cpus));
+
+	// Reserve all worker slots up front so they can steal from each other as soon as they start
+	context->num_cords = num_cords;
+	context->num_workers = num_cords + FIBER_GUEST_SLOTS;
+	context->workers = TC_ALLOC(a, context->num_workers * sizeof(void*));
+	context->worker_region = os_reserve((context->num_workers + 1) * (size_t)FIBER_STACK_SIZE);
+	TC_ASSERT(context->worker_region);
+	char* base = (char*)(((size_t)context->worker_region + FIBER_STACK_SIZE - 1) & ~((size_t)FIBER_STACK_SIZE - 1));
+	for (int i = 0; i < context->num_workers; i++) {
+		context->workers[i] = (worker_t*)(base + (size_t)i * FIBER_STACK_SIZE);
+		os_commit(context->workers[i], FIBER_STACK_SIZE);
 	}
 
 	// Initialize main thread
-	worker_t* main_cord = TC_ALLOC(a, FIBER_STACK_SIZE);
-	worker_init(&(struct worker_args) { main_cord, "main_%i", 0 });
+	worker_t* main_cord = context->workers[0];
+	worker_init(&(struct worker_args) { main_cord, "main_%i", 0, cpus[0] });
 	context->main = main_cord;
 
-	context->num_cords = num_cords;
-	context->workers = TC_ALLOC(a, num_cords * sizeof(void*));
-	context->workers[0] = main_cord;
+	// Guest slots are only set up, threads outside the pool run them while waiting
+	for (int i = num_cords; i < context->num_workers; i++)
+		worker_setup(context->workers[i], "guest_%i", i);
 
 	// Initialize non-main threads with arguments per thread
-	if (uv_sem_init(&context->sem, 0))
+	if (uv_sem_init(&context->sem, 0) || uv_sem_init(&context->start, 0))
 		TRACE(LOG_ERROR, "[Thread]: Could not create semophore.");
 
 	for (int i = 1; i < num_cords; i++) {
-		worker_t* c = TC_ALLOC(a, FIBER_STACK_SIZE);
-		memset(c, 0, FIBER_STACK_SIZE);
-		context->workers[i] = c;
-		struct worker_args args = (struct worker_args){ c, "worker_%i", i };
+		worker_t* c = context->workers[i];
+		struct worker_args args = (struct worker_args){ c, "worker_%i", i, cpus[i] };
 		os_create_thread(worker_entry, &args, CHUNK_SIZE);
 
 		uv_sem_wait(&context->sem);
 	}
-	lf_lifo_init(&context->ready);
-	
-	spin_lock_init(&context->timer_pool_lock);
-	slab_create(&context->timer_pool, a, CHUNK_SIZE);
+	for (int i = 1; i < num_cords; i++)
+		uv_sem_post(&context->start);
+	TC_FREE(a, cpus, num_cpus * sizeof(cpuinfo_t));
 }
 
 void fiber_pool_destroy(tc_allocator_i* a)
 {
-	slab_destroy(context->timer_pool);
-
 	worker_t* c = worker();
 	TC_ASSERT(c == context->main);
-	TC_ASSERT(lf_lifo_is_empty(&context->ready));
 
-	// Destroy fibers
-	for (int i = 0; i < context->num_fibers; i++) {
-		fiber_destroy(context->fibers[i]);
-	}
 	// Destroy cords
 	for (int i = 1; i < context->num_cords; i++) {
 		worker_t* worker = context->workers[i];
-		lf_lifo_push(&context->ready, &worker->sched.state);
+		tc_fiber_ready(&worker->sched);
 		uv_sem_wait(&context->sem);
 		uv_loop_close(&worker->loop);
 	}
 	uv_sem_destroy(&context->sem);
+	uv_sem_destroy(&context->start);
+	worker_exit(c);
+	uv_loop_close(&c->loop);
+	for (int i = context->num_cords; i < context->num_workers; i++) {
+		worker_t* guest = context->workers[i];
+		TC_ASSERT(atomic_load(&guest->guest) == 0);
+		worker_exit(guest);
+		uv_loop_close(&guest->loop);
+	}
+
+	for (int i = 0; i < JOB_PRIORITY_COUNT; i++) {
+		for (int j = 0; j < context->num_workers; j++)
+			ws_deque_destroy(context->workers[j]->deque[i]);
+		lf_queue_destroy(context->job_queue[i]);
+	}
+	for (int i = 0; i < FIBER_STACK_COUNT; i++) {
+		fiberclass_t* cls = &context->classes[i];
+		size_t num_created = atomic_load(&cls->num_created);
+		for (size_t j = 0; j < num_created; j++)
+			scratch_release(&((fiber_t*)(cls->base + j * cls->stride))->scratch);
+		if (cls->region)
+			os_unmap(cls->region, cls->reserved);
+	}
 
-	lf_queue_destroy(context->job_queue);
+	for (int i = 0; i < context->num_workers; i++)
+		job_clear_recycled(context->workers[i]);
 
-	TC_FREE(a, context->workers, context->num_cords * sizeof(void*));
+	os_unmap(context->worker_region, (context->num_workers + 1) * (size_t)FIBER_STACK_SIZE);
+	TC_FREE(a, context->workers, context->num_workers * sizeof(void*));
 	TC_FREE(a, context, sizeof(fiber_context_t));
 }
 
-void tc_fiber_yield(lock_t* lk)
+/** Does what the previous fiber left to do after switching out, which it could not do on its own stack */
+static void fiber_switched(fcontext_transfer_t t)
 {
+	// The previous fiber can only be resumed once its context is stored
+	fiber_t* prev = t.data;
+	prev->fctx = t.ctx;
 	worker_t* c = worker();
-	fiber_t* curr = c->curr_fiber;
-	c->curr_fiber = &c->sched;
-	c->fiblk = lk;
-	if (curr != &c->sched) {
-		fcontext_t ctx = c->sched.fctx;
-		TC_ASSERT(ctx != NULL);
-		fcontext_t fctx = jump_fcontext(ctx, &c->sched).ctx;
-		worker()->sched.fctx = fctx;
+	// Unlock the lock that was left behind by the fiber
+	if (c->fiblk) {
+		TC_UNLOCK(c->fiblk);
+		c->fiblk = NULL;
+	}
+	// Fiber asked to be scheduled again after it was switched out
+	if (c->requeue) {
+		tc_fiber_ready(c->requeue);
+		c->requeue = NULL;
+	}
+	// If fiber is done we can put it on the free stack
+	if (c->finished) {
+		fiber_destroy(c->finished);
+		c->finished = NULL;
 	}
-	else worker_loop(c);
 }
 
-void tc_fiber_resume(fiber_t* f)
+/** Switches from the current fiber to another fiber on this worker */
+static void fiber_switch(worker_t* c, fiber_t* curr, fiber_t* f)
 {
-	worker_t* c = worker();
-	fiber_t* curr = c->curr_fiber;
 	TC_ASSERT(f != curr);
-	TC_ASSERT(curr == &c->sched);
-	TC_ASSERT(lf_lifo_is_empty(&f->state));
 	c->curr_fiber = f;
+	f->worker = c->id;
 	fcontext_t ctx = f->fctx;
-	//TRACE(LOG_INFO, "%i", f->id);
 	TC_ASSERT(ctx != NULL);
 	f->fctx = NULL;
+	fiber_switched(jump_fcontext(ctx, curr));
+}
+
+/**
+ * Readies a fiber woken by the current fiber, it is switched to directly when the current fiber blocks or finishes.
+ * Until then an idle worker can steal it, one is woken up unless the current fiber is about to switch out anyway.
+ */
+static void fiber_handoff(fiber_t* f)
+{
+	worker_t* c = worker();
+	if (!c || f->id == 0 || c->curr_fiber == &c->sched) {
+		tc_fiber_ready(f);
+		return;
+	}
 	TC_ASSERT(f->job != NULL);
-	f->fctx = jump_fcontext(ctx, f).ctx;
-	TC_ASSERT(f->fctx != NULL);
+	lf_lifo_init(&f->state);
+	// Only the last woken fiber is switched to directly, it is the most likely to use what we just produced
+	fiber_t* prev = (fiber_t*)atomic_exchange(&c->handoff, (atomic_t)f);
+	if (prev)
+		tc_fiber_ready(prev);
+	if (!c->curr_fiber->blocking)
+		worker_wake_any();
+}
 
-	// Unlock the lock that was left behind by the fiber
-	if (c->fiblk) {
-		TC_UNLOCK(c->fiblk);
+void tc_fiber_yield(lock_t* lk)
+{
+	worker_t* c = worker();
+	fiber_t* curr = c->curr_fiber;
+	c->fiblk = lk;
+	if (curr != &c->sched) {
+		// Skip the scheduler when we woke up a fiber that an idle worker did not steal yet
+		fiber_t* next = NULL;
+		if (atomic_load_explicit(&c->handoff, memory_order_relaxed))
+			next = (fiber_t*)atomic_exchange(&c->handoff, 0);
+		fiber_switch(c, curr, next ? next : &c->sched);
+	}
+	else {
+		// The scheduler fiber keeps running on its own stack, so the lock can be released right away
 		c->fiblk = NULL;
+		if (lk)
+			TC_UNLOCK(lk);
+		worker_loop(c);
 	}
 }
 
-static void fiber_destroy(fiber_t* f) { lf_lifo_push(&context->free_list, &f->state); }
+void tc_fiber_resume(fiber_t* f)
+{
+	worker_t* c = worker();
+	TC_ASSERT(c->curr_fiber == &c->sched);
+	TC_ASSERT(lf_lifo_is_empty(&f->state));
+	TC_ASSERT(f->job != NULL);
+	fiber_switch(c, &c->sched, f);
+}
+
+/** Yields the current fiber and puts it at the back of the ready queue */
+static void fiber_reschedule()
+{
+	worker_t* c = worker();
+	TC_ASSERT(c->curr_fiber != &c->sched);
+	c->requeue = c->curr_fiber;
+	tc_fiber_yield(NULL);
+}
+
+static void fiber_destroy(fiber_t* f)
+{
+	fiberclass_t* cls = &context->classes[f->stack_class];
+	atomic_store_explicit(&cls->last_free, uv_now(&worker()->loop), memory_order_relaxed);
+	lf_lifo_push(&cls->free_list, &f->state);
+	// Workers that put back a job for lack of fibers are parked until one is freed
+	if (atomic_load(&context->num_stalled))
+		worker_wake_any();
+}
+
+static void fiber_trim(worker_t* c)
+{
+	uint64_t now = uv_now(&c->loop);
+	for (int i = 0; i < FIBER_STACK_COUNT; i++) {
+		fiberclass_t* cls = &context->classes[i];
+		// Only shrink when the pool grew and no fiber of this class finished for a while
+		if (atomic_load_explicit(&cls->num_committed, memory_order_relaxed) <= cls->num_fibers ||
+			now - atomic_load_explicit(&cls->last_free, memory_order_relaxed) < FIBER_TRIM_DELAY ||
+			!spin_try_lock(&cls->trim_lock))
+			continue;
+		// Only take the surplus out of the free list, other workers keep finding the rest in there
+		fiber_t* f;
+		while (atomic_load(&cls->num_committed) > cls->num_fibers && (f = lf_lifo_pop(&cls->free_list))) {
+			fiber_decommit(f);
+			lf_lifo_push(&cls->cold_list, &f->state);
+		}
+		TC_UNLOCK(&cls->trim_lock);
+	}
+}
 
 static int stack_direction(int* prev_stack_ptr)
 {
@@ -368,13 +1187,13 @@ static int stack_direction(int* prev_stack_ptr)
 	return &dummy < prev_stack_ptr ? -1 : 1;
 }
 
-static void fiber_init(fiber_t* fiber, uint32_t id, fiber_func func)
+static void fiber_init(fiber_t* fiber, uint32_t id, uint32_t stack_size, fiber_func func)
 {
 	// Initialize fiber
 	TC_ASSERT(lf_lifo(&fiber->state) == &fiber->state);
 	fiber->id = id;
 	if (func) {
-		fiber->stack_size = FIBER_STACK_SIZE - 3 * CHUNK_SIZE;
+		fiber->stack_size = stack_size;
 		fiber->stack_ptr = ((char*)fiber) + 2 * CHUNK_SIZE;
 		// Setup guard pages around the stack for protection against stack overflow
 		os_guard_page(fiber->stack_ptr - CHUNK_SIZE, CHUNK_SIZE);
@@ -390,18 +1209,29 @@ static void fiber_init(fiber_t* fiber, uint32_t id, fiber_func func)
 	}
 }
 
-static fiber_t* fiber_create(const char* name)
+static fiber_t* fiber_create(const char* name, fiberstack_t stack)
 {
-	fiber_t* fiber = lf_lifo_pop(&context->free_list);
-	if (fiber) {
-		lf_lifo_init(&fiber->state);
-		strncpy(fiber->name, name, FIBER_NAME_LEN);
-		return fiber;
+	// Fall back to bigger stacks when all fibers of the class are in use
+	for (int i = stack; i < FIBER_STACK_COUNT; i++) {
+		// Fibers with a committed stack first, then the ones whose stack was released
+		fiber_t* fiber = lf_lifo_pop(&context->classes[i].free_list);
+		if (!fiber)
+			fiber = lf_lifo_pop(&context->classes[i].cold_list);
+		if (!fiber)
+			fiber = fiber_grow(i);
+		if (fiber) {
+			lf_lifo_init(&fiber->state);
+			// Stack was released while the fiber was idle
+			if (fiber->fctx == NULL)
+				fiber_commit(fiber);
+			strncpy(fiber->name, name, FIBER_NAME_LEN);
+			return fiber;
+		}
 	}
-	else return NULL;
+	return NULL;
 }
 
-static void fiber_start(fiber_t* f, const jobdecl_t* job)
+static void fiber_start(fiber_t* f, job_t* job)
 {
 	TC_ASSERT(f->id != 0);
 	TC_ASSERT(job);
@@ -417,120 +1247,319 @@ static void fiber_start(fiber_t* f, const jobdecl_t* job)
 /*					SYNCHRONIZATION	COUNTER					*/
 /*==========================================================*/
 
-typedef struct {
-	/**
-	 * When running counter_wait() the fiber sleeps
-	 * until the counter is this value
-	 */
-	atomic_t fiber;
-	atomic_t inuse;
-	size_t value;
-} fiber_entry;
+enum {
+	FUT_WATCH_BITS = 16,											// Number of bits in the mask of watched values
+	FUT_VALUE_BITS = sizeof(size_t) * 8 - FUT_WATCH_BITS,			// Number of bits left for the counter
+};
 
-typedef struct tc_fut_s {
-	tc_allocator_i* a;
+#define FUT_VALUE_MASK (((size_t)1 << FUT_VALUE_BITS) - 1)
+#define FUT_WATCH(_v) ((size_t)1 << (FUT_VALUE_BITS + ((_v) & (FUT_WATCH_BITS - 1))))
+
+#define WAITANY_BUSY (~(size_t)0)
+
+/** Shared by the waiters of a fiber that waits on several sources at once, the first source to fire claims it */
+typedef struct waitany_s {
+	// Index + 1 of the source that fired first, 0 while sleeping or WAITANY_BUSY while registering
+	atomic_t claim;
+	// Fiber that waits
+	fiber_t* fiber;
+	// Thread outside the pool that blocks instead, when no guest slot was free
+	uv_sem_t* sem;
+	// Held by the waiter until it switched out
+	lock_t lock;
+} waitany_t;
+
+typedef struct fut_waiter_s {
+	// Next waiter in the list of the future
+	struct fut_waiter_s* next;
+	// Fiber that sleeps until the counter is this value
+	fiber_t* fiber;
+	size_t value;
+	// Job that is queued instead of resuming a fiber, for continuations
+	job_t* job;
+	// Thread outside the pool that blocks until the counter is this value, when no guest slot was free
+	uv_sem_t* sem;
+	// Wait this waiter is part of when waiting on several futures, with the index of this future
+	waitany_t* any;
+	uint32_t index;
+} fut_waiter_t;
+
+typedef struct tc_fut_s {
+	tc_allocator_i* a;
+	// Counter in the low bits, the high bits are set for values that fibers are waiting on
 	atomic_t value;
-	uint32_t num_slots;
+	// Protects the waiter list
+	lock_t lock;
+	// Intrusive list of waiters that live on the stack of the waiting fibers
+	fut_waiter_t* waiters;
 	tc_waitable_i* waitable;
 } fut_t;
 
 
-/* Atomic counter methods, used for waiting */
-static void counter_wakeup(fut_t* c, size_t value)
+/**
+ * Claims a wait on several sources for the source at index, called with the lock of the source held.
+ * Sets claimed when this source was first and returns the fiber to resume after unlocking, if it already sleeps.
+ */
+static fiber_t* waitany_claim(waitany_t* any, uint32_t index, bool* claimed)
 {
-	fiber_entry* slots = (fiber_entry*)(c + 1);
-	for (uint32_t i = 0; i < c->num_slots; i++) {
-		fiber_t* f = atomic_load_explicit(&slots[i].fiber, memory_order_acquire);
-		if (f == NULL) {
-			continue;
+	size_t expected = atomic_load(&any->claim);
+	do {
+		if (expected != 0 && expected != WAITANY_BUSY) {
+			*claimed = false;
+			return NULL;
 		}
-		if (atomic_load_explicit(&slots[i].inuse, memory_order_acquire)) {
-			continue;
-		}
-		if (slots[i].value == value) {
-			size_t expected = 0;
-			if (!atomic_compare_exchange_strong_explicit(&slots[i].inuse, &expected, true, memory_order_seq_cst, memory_order_relaxed)) {
-				continue;
-			}
+	} while (!atomic_compare_exchange_weak(&any->claim, &expected, index + 1));
+	*claimed = true;
+	// Still registering, the waiter sees the claim and does not go to sleep
+	if (expected == WAITANY_BUSY)
+		return NULL;
+	if (any->sem) {
+		uv_sem_post(any->sem);
+		return NULL;
+	}
+	// Waiter announced it sleeps, make sure it switched out before it is resumed
+	fiber_t* f = any->fiber;
+	TC_LOCK(&any->lock);
+	TC_UNLOCK(&any->lock);
+	return f;
+}
 
-			atomic_store_explicit(&slots[i].fiber, 0, memory_order_release);
-			TC_ASSERT(f->id == 0 || f->job);
-			tc_fiber_ready(f);
-		}
+/** Claims the wait from the waiting fiber itself when a source was ready during registration */
+static void waitany_claim_self(waitany_t* any, uint32_t index)
+{
+	size_t expected = WAITANY_BUSY;
+	atomic_compare_exchange_strong(&any->claim, &expected, index + 1);
+}
+
+/** Sleeps until a source claimed the wait unless one did during registration, returns the index of the source */
+static uint32_t waitany_sleep(waitany_t* any)
+{
+	size_t expected = WAITANY_BUSY;
+	TC_LOCK(&any->lock);
+	if (!atomic_compare_exchange_strong(&any->claim, &expected, 0))
+		TC_UNLOCK(&any->lock);
+	else if (any->sem) {
+		TC_UNLOCK(&any->lock);
+		uv_sem_wait(any->sem);
 	}
+	else
+		tc_fiber_yield(&any->lock);
+	return (uint32_t)(atomic_load(&any->claim) - 1);
 }
 
-static bool counter_add_to_waiting(fut_t* c, size_t value)
+static size_t fut_value(fut_t* c)
 {
-	fiber_t* f = tc_fiber();
-	fiber_entry* slots = (fiber_entry*)(c + 1);
-	for (uint32_t i = 0; i < c->num_slots; i++) {
-		size_t expected = 0;
-		if (!atomic_compare_exchange_strong_explicit(&slots[i].fiber, &expected, f, memory_order_seq_cst, memory_order_relaxed))
-			continue;
-		slots[i].value = value;
-		// Signal slot is ready
-		atomic_store_explicit(&slots[i].inuse, 0, memory_order_seq_cst);
+	return atomic_load(&c->value) & FUT_VALUE_MASK;
+}
 
-		size_t probed = atomic_load_explicit(&c->value, memory_order_relaxed);
-		if (atomic_load_explicit(&slots[i].inuse, memory_order_acquire)) {
-			return false;
+/** Clears the watched bits that no waiter needs anymore, called with the lock held */
+static void fut_unwatch(fut_t* c)
+{
+	size_t watched = 0;
+	for (fut_waiter_t* w = c->waiters; w; w = w->next)
+		watched |= FUT_WATCH(w->value);
+	atomic_fetch_and(&c->value, watched | FUT_VALUE_MASK);
+}
+
+/* Atomic counter methods, used for waiting */
+static void counter_wakeup(fut_t* c, size_t value)
+{
+	// Take the waiters for this value out of the list, they are only resumed after unlocking
+	fut_waiter_t* ready = NULL;
+	TC_LOCK(&c->lock);
+	fut_waiter_t** prev = &c->waiters;
+	while (*prev) {
+		fut_waiter_t* w = *prev;
+		if (w->value == value) {
+			*prev = w->next;
+			if (w->any) {
+				// Only the first source of a wait on several futures resumes the fiber
+				bool claimed;
+				w->fiber = waitany_claim(w->any, w->index, &claimed);
+				if (!w->fiber)
+					continue;
+			}
+			w->next = ready;
+			ready = w;
 		}
-		if (slots[i].value == probed) {
-			expected = 0;
-			if (!atomic_compare_exchange_strong_explicit(&slots[i].inuse, &expected, true, memory_order_seq_cst, memory_order_relaxed))
-				return false;
-			//Slot is now free, in use slays true
-			atomic_store_explicit(&slots[i].fiber, 0, memory_order_release);
-			return true;
+		else prev = &w->next;
+	}
+	fut_unwatch(c);
+	TC_UNLOCK(&c->lock);
+	// The future and the waiters can be gone as soon as a fiber is resumed
+	while (ready) {
+		fut_waiter_t* next = ready->next;
+		fiber_t* f = ready->fiber;
+		if (ready->job)
+			job_push(ready->job);
+		else if (ready->sem)
+			uv_sem_post(ready->sem);
+		else {
+			TC_ASSERT(f->id == 0 || f->job);
+			fiber_handoff(f);
 		}
-		return false;
+		ready = next;
 	}
+}
+
+/**
+ * Adds a waiter to the future. Returns true with the lock held when the waiter has to wait,
+ * or false when the counter already has the value.
+ */
+static bool counter_add_to_waiting(fut_t* c, fut_waiter_t* w)
+{
+	TC_LOCK(&c->lock);
+	w->next = c->waiters;
+	c->waiters = w;
+	// Setting the watched bit and reading the counter is one operation so no update is missed
+	size_t old = atomic_fetch_or(&c->value, FUT_WATCH(w->value));
+	if ((old & FUT_VALUE_MASK) != w->value)
+		return true;
+	c->waiters = w->next;
+	fut_unwatch(c);
+	TC_UNLOCK(&c->lock);
 	return false;
 }
 
-fut_t* tc_fut_new(tc_allocator_i* a, size_t value, tc_waitable_i* waitable, uint32_t num_slots)
+fut_t* tc_fut_new(tc_allocator_i* a, size_t value, tc_waitable_i* waitable)
 {
-	fut_t* c = TC_ALLOC(a, sizeof(fut_t) + num_slots * sizeof(fiber_entry));
-	memset(c, 0, sizeof(fut_t) + num_slots * sizeof(fiber_entry));
+	TC_ASSERT(value <= FUT_VALUE_MASK);
+	// Workers reuse futures they freed before, other threads and allocators go to the allocator
+	worker_t* w = worker();
+	fut_t* c = (w && a == context->a) ? magazine_pop(&w->futures) : NULL;
+	if (!c)
+		c = TC_ALLOC(a, sizeof(fut_t));
+	memset(c, 0, sizeof(fut_t));
 	c->a = a;
-	c->num_slots = num_slots;
 	c->waitable = waitable;
+	spin_lock_init(&c->lock);
 	atomic_store(&c->value, value);
-	fiber_entry* slots = (fiber_entry*)(c + 1);
-	for (uint32_t i = 0; i < c->num_slots; i++)
-		atomic_store(&slots[i].inuse, true);
 	return c;
 }
 
 void tc_fut_free(fut_t* c)
 {
+	TC_ASSERT(c->waiters == NULL);
 	if (c->waitable && c->waitable->dtor && c->waitable->instance)
 		c->waitable->dtor(c->waitable->instance);
-	TC_FREE(c->a, c, sizeof(fut_t) + c->num_slots * sizeof(fiber_entry));
+	worker_t* w = worker();
+	if (!w || c->a != context->a || !magazine_push(&w->futures, c))
+		TC_FREE(c->a, c, sizeof(fut_t));
 }
 
 size_t tc_fut_incr(fut_t* c)
 {
-	size_t val = atomic_fetch_add_explicit(&c->value, 1, memory_order_seq_cst) + 1;
-	counter_wakeup(c, val);
+	size_t old = atomic_fetch_add_explicit(&c->value, 1, memory_order_seq_cst);
+	size_t val = (old + 1) & FUT_VALUE_MASK;
+	// Waiters announce themselves in the same word, so the list is only touched for watched values
+	if (old & FUT_WATCH(val))
+		counter_wakeup(c, val);
 	return val;
 }
 
 size_t tc_fut_decr(fut_t* c)
 {
-	size_t val = atomic_fetch_sub_explicit(&c->value, 1, memory_order_seq_cst) - 1;
-	counter_wakeup(c, val);
+	size_t old = atomic_fetch_sub_explicit(&c->value, 1, memory_order_seq_cst);
+	size_t val = (old - 1) & FUT_VALUE_MASK;
+	TC_ASSERT(old & FUT_VALUE_MASK);
+	if (old & FUT_WATCH(val))
+		counter_wakeup(c, val);
 	return val;
 }
 
+/** Blocks a thread outside the pool until the counter reaches value */
+static void fut_wait_thread(fut_t* c, size_t value)
+{
+	uv_sem_t sem;
+	uv_sem_init(&sem, 0);
+	fut_waiter_t w = { NULL, NULL, value, NULL };
+	w.sem = &sem;
+	if (counter_add_to_waiting(c, &w)) {
+		TC_UNLOCK(&c->lock);
+		uv_sem_wait(&sem);
+	}
+	uv_sem_destroy(&sem);
+}
+
 int64_t tc_fut_wait(fut_t* c, size_t value)
 {
-	bool done = counter_add_to_waiting(c, value);
-	if (!done) tc_fiber_yield(NULL);
+	if (fut_value(c) != value) {
+		// Threads outside the pool run jobs in a guest slot until the counter is done
+		worker_t* guest = worker() ? NULL : guest_enter();
+		if (worker()) {
+			fut_waiter_t w = { NULL, tc_fiber(), value, NULL };
+			// Lock is released once we switched out, the waker takes us off the list
+			if (counter_add_to_waiting(c, &w))
+				tc_fiber_yield(&c->lock);
+		}
+		else fut_wait_thread(c, value);
+		if (guest)
+			guest_leave(guest);
+	}
 	return c->waitable->results;
 }
 
+static void fut_remove_waiter(fut_t* c, fut_waiter_t* w)
+{
+	TC_LOCK(&c->lock);
+	for (fut_waiter_t** prev = &c->waiters; *prev; prev = &(*prev)->next) {
+		if (*prev == w) {
+			*prev = w->next;
+			break;
+		}
+	}
+	fut_unwatch(c);
+	TC_UNLOCK(&c->lock);
+}
+
+uint32_t tc_fut_wait_any(fut_t** futs, uint32_t count, size_t value)
+{
+	TC_ASSERT(count > 0 && count <= FIBER_WAIT_ANY_MAX);
+	for (uint32_t i = 0; i < count; i++) {
+		if (fut_value(futs[i]) == value)
+			return i;
+	}
+	// Threads outside the pool run jobs in a guest slot or block on a semaphore, like in tc_fut_wait
+	worker_t* guest = worker() ? NULL : guest_enter();
+	uv_sem_t sem;
+	waitany_t any = { 0 };
+	atomic_init(&any.claim, WAITANY_BUSY);
+	if (worker())
+		any.fiber = tc_fiber();
+	else {
+		uv_sem_init(&sem, 0);
+		any.sem = &sem;
+	}
+	spin_lock_init(&any.lock);
+	// Small fiber stacks cannot fit waiters for every future
+	fut_waiter_t inline_waiters[FIBER_WAIT_ANY_INLINE];
+	fut_waiter_t* waiters = count <= FIBER_WAIT_ANY_INLINE ? inline_waiters : TC_ALLOC(context->a, count * sizeof(fut_waiter_t));
+	uint32_t num_waiting = 0;
+	for (; num_waiting < count; num_waiting++) {
+		fut_waiter_t* w = &waiters[num_waiting];
+		memset(w, 0, sizeof(fut_waiter_t));
+		w->value = value;
+		w->any = &any;
+		w->index = num_waiting;
+		if (!counter_add_to_waiting(futs[num_waiting], w)) {
+			waitany_claim_self(&any, num_waiting);
+			break;
+		}
+		TC_UNLOCK(&futs[num_waiting]->lock);
+	}
+	uint32_t index = waitany_sleep(&any);
+	// Futures that did not fire still have our waiters in their lists
+	for (uint32_t i = 0; i < num_waiting; i++)
+		fut_remove_waiter(futs[i], &waiters[i]);
+	if (waiters != inline_waiters)
+		TC_FREE(context->a, waiters, count * sizeof(fut_waiter_t));
+	if (any.sem)
+		uv_sem_destroy(&sem);
+	if (guest)
+		guest_leave(guest);
+	return index;
+}
+
 int64_t tc_fut_wait_and_free(fut_t* c, size_t value)
 {
 	int64_t result = tc_fut_wait(c, value);
@@ -543,19 +1572,40 @@ int64_t tc_fut_wait_and_free(fut_t* c, size_t value)
 /*							JOBS							*/
 /*==========================================================*/
 
+/** Recycling size class of a job request, FIBER_REQUEST_CLASSES for requests that are too big */
+static uint32_t job_request_class(size_t num_jobs)
+{
+	uint32_t i = 0;
+	while (i < FIBER_REQUEST_CLASSES && ((size_t)1 << i) < num_jobs)
+		i++;
+	return i;
+}
+
+static size_t job_request_size(size_t num_jobs)
+{
+	uint32_t i = job_request_class(num_jobs);
+	if (i < FIBER_REQUEST_CLASSES)
+		num_jobs = (size_t)1 << i;
+	return sizeof(jobrequest_t) + num_jobs * sizeof(job_t);
+}
+
 fut_t* tc_run_jobs(jobdecl_t* jobs, uint32_t num_jobs, int64_t* results)
 {
-	// Allocate space for request struct and additional jobs
-	jobrequest_t* req = TC_ALLOC(
-		context->a,
-		sizeof(jobrequest_t) + num_jobs * (sizeof(job_t)));
+	// Allocate space for request struct and additional jobs, small batches reuse requests of this worker
+	worker_t* w = worker();
+	uint32_t cls = job_request_class(num_jobs);
+	jobrequest_t* req = (w && cls < FIBER_REQUEST_CLASSES) ? magazine_pop(&w->requests[cls]) : NULL;
+	if (!req)
+		req = TC_ALLOC(context->a, job_request_size(num_jobs));
 	req->instance = req;
 	req->dtor = job_destroy;
 	req->num_jobs = num_jobs;
 	req->results = 0;
 	req->result_ptr = results;
+	req->complete = NULL;
+	req->skip = NULL;
 
-	fut_t* future = tc_fut_new(context->a, num_jobs, req, 4);
+	fut_t* future = tc_fut_new(context->a, num_jobs, req);
 	job_t* j = (job_t*)((size_t)req + sizeof(jobrequest_t));
 	for (uint32_t i = 0; i < num_jobs; i++) {
 		j[i].func = jobs[i].func;
@@ -563,251 +1613,1892 @@ fut_t* tc_run_jobs(jobdecl_t* jobs, uint32_t num_jobs, int64_t* results)
 		j[i].future = future;
 		j[i].id = i;
 		j[i].req = req;
-		lf_queue_put(context->job_queue, &j[i]);
+		j[i].next = NULL;
+		j[i].priority = jobs[i].priority;
+		j[i].stack = jobs[i].stack;
+		j[i].cancel = jobs[i].cancel;
+		TC_ASSERT(j[i].priority < JOB_PRIORITY_COUNT);
+		TC_ASSERT(j[i].stack < FIBER_STACK_COUNT);
 	}
+	job_push_n(j, num_jobs);
 	return future;
 }
 
-static void job_destroy(jobrequest_t* req)
+typedef struct {
+	jobrequest_t;
+	job_t job;
+	// Queues the job when the source future completes
+	fut_waiter_t waiter;
+	jobdecl_t decl;
+	fut_t* source;
+	// Result of the source future, read by tc_job_input
+	int64_t input;
+} continuation_t;
+
+static void continuation_destroy(continuation_t* cont)
 {
-	TC_FREE(context->a, req, sizeof(jobrequest_t) + req->num_jobs * (sizeof(job_t)));
+	TC_FREE(context->a, cont, sizeof(continuation_t));
 }
 
-static void job_finish(job_t* job, int64_t result)
+static int64_t continuation_run(void* arg)
 {
-	// If we have an output array place the result in there
-	if (job->req->result_ptr)
-		job->req->result_ptr[job->id] = result;
-	// Also place the result in the future result (overwriting previous results)
-	job->req->results = result;
-	// Decrement atomic counter to signal job is done
-	tc_fut_decr(job->future);
+	continuation_t* cont = arg;
+	cont->input = cont->source->waitable ? cont->source->waitable->results : 0;
+	tc_fut_free(cont->source);
+	cont->source = NULL;
+	return cont->decl.func(cont->decl.data);
 }
 
-static jobdecl_t* job_next()
+static void continuation_skip(job_t* job)
 {
-	jobdecl_t* job = NULL;
-	lf_queue_get(context->job_queue, &job);
-	return job;
+	continuation_t* cont = (continuation_t*)job->req;
+	tc_fut_free(cont->source);
+	cont->source = NULL;
 }
 
-/*==========================================================*/
-/*							TIMERS							*/
-/*==========================================================*/
+fut_t* tc_fut_then(fut_t* fut, jobdecl_t job)
+{
+	TC_ASSERT(job.func);
+	TC_ASSERT(job.priority < JOB_PRIORITY_COUNT);
+	TC_ASSERT(job.stack < FIBER_STACK_COUNT);
+	continuation_t* cont = TC_ALLOC(context->a, sizeof(continuation_t));
+	memset(cont, 0, sizeof(continuation_t));
+	cont->instance = cont;
+	cont->dtor = continuation_destroy;
+	cont->num_jobs = 1;
+	cont->decl = job;
+	cont->source = fut;
+	cont->skip = continuation_skip;
+	fut_t* future = tc_fut_new(context->a, 1, cont);
+	cont->job.func = continuation_run;
+	cont->job.data = cont;
+	cont->job.future = future;
+	cont->job.req = (jobrequest_t*)cont;
+	cont->job.priority = job.priority;
+	cont->job.stack = job.stack;
+	cont->job.cancel = job.cancel;
+	cont->waiter.value = 0;
+	cont->waiter.job = &cont->job;
+	// Queue right away when the source is already done, otherwise the last decrement does it
+	if (fut_value(fut) != 0 && counter_add_to_waiting(fut, &cont->waiter))
+		TC_UNLOCK(&fut->lock);
+	else
+		job_push(&cont->job);
+	return future;
+}
 
-static
-void timer_cb(uv_timer_t* handle)
+int64_t tc_job_input()
 {
-	timer_t* timer = (timer_t*)handle->data;
-	if (--timer->repeats == 0) {
-		uv_timer_stop(&timer->handle);
-		timer->results = 0;
-	}
-	tc_fut_decr(timer->future);
+	job_t* job = job_current();
+	if (job && job->func == continuation_run)
+		return ((continuation_t*)job->req)->input;
+	return 0;
 }
 
-static
-void timer_destroy(timer_t* timer)
+static void job_spill(job_t* job)
 {
-	TC_LOCK(&context->timer_pool_lock);
-	slab_free(context->timer_pool, timer);
-	TC_UNLOCK(&context->timer_pool_lock);
+	jobpriority_t p = job->priority;
+	TC_LOCK(&context->spill_lock);
+	if (context->spill_tail[p])
+		context->spill_tail[p]->next = job;
+	else
+		context->spill_head[p] = job;
+	context->spill_tail[p] = job;
+	atomic_fetch_add(&context->num_spilled[p], 1);
+	TC_UNLOCK(&context->spill_lock);
 }
 
-fut_t* tc_timer_start(uint64_t timeout, uint64_t repeats)
+static job_t* job_unspill(jobpriority_t p)
 {
-	if (repeats) {
-		TC_LOCK(&context->timer_pool_lock);
-		timer_t* timer = slab_alloc(context->timer_pool);
-		TC_UNLOCK(&context->timer_pool_lock);
-		timer->handle.data = timer;
-		timer->timeout = timeout;
-		timer->repeats = repeats;
-		timer->instance = timer;
-		timer->dtor = timer_destroy;
-		timer->future = tc_fut_new(context->a, repeats, timer, 4);
-		uv_timer_init(tc_eventloop(), &timer->handle);
-		uv_timer_start(&timer->handle, timer_cb, timeout, timeout);
-		return timer->future;
+	if (atomic_load_explicit(&context->num_spilled[p], memory_order_relaxed) == 0)
+		return NULL;
+	TC_LOCK(&context->spill_lock);
+	job_t* job = context->spill_head[p];
+	if (job) {
+		context->spill_head[p] = job->next;
+		if (context->spill_head[p] == NULL)
+			context->spill_tail[p] = NULL;
+		job->next = NULL;
+		atomic_fetch_sub(&context->num_spilled[p], 1);
 	}
-	else return 0;
+	TC_UNLOCK(&context->spill_lock);
+	return job;
 }
 
+/** Puts a job back that was taken by this worker but could not be started */
+static void job_requeue(worker_t* c, job_t* job)
+{
+	if (!ws_deque_push(c->deque[job->priority], job))
+		job_spill(job);
+}
 
-/*==========================================================*/
-/*							CHANNELS						*/
-/*==========================================================*/
-
-typedef struct tc_channel_s {
-	tc_allocator_i* base;
-	lock_t lock;
-	slist_t producers;
-	slist_t consumers;
-	uint32_t cap;
-	uint32_t head;
-	uint32_t tail;
-	bool closed;
-} tc_channel_t;
+static bool job_try_push(worker_t* c, job_t* job)
+{
+	jobpriority_t p = job->priority;
+	// Workers keep their own jobs local, everything else goes through the shared queue
+	bool queued = (c && ws_deque_push(c->deque[p], job)) || lf_queue_put(context->job_queue[p], job);
+	if (!queued) {
+		// Queues are full, overflow into the spill list unless we should apply backpressure
+		if (context->backpressure != BACKPRESSURE_SPILL &&
+			atomic_load_explicit(&context->num_spilled[p], memory_order_relaxed) >= context->max_spilled)
+			return false;
+		job_spill(job);
+	}
+	worker_wake_any();
+	return true;
+}
 
+/**
+ * Starts a job that could not be queued on a fiber of its stack class right away,
+ * the submitting fiber is readied again once we switched out. Returns false when no fiber is free.
+ */
+static bool job_run_now(worker_t* c, job_t* job)
+{
+	fiber_t* f = fiber_create("inline", job->stack);
+	if (!f)
+		return false;
+	TC_ASSERT(f->job == NULL);
+	atomic_store(&f->job, (atomic_t)job);
+	c->requeue = c->curr_fiber;
+	fiber_switch(c, c->curr_fiber, f);
+	return true;
+}
 
-static void queue_notify_one(slist_t* queue)
+static void job_push(job_t* job)
 {
-	while (!slist_empty(queue)) {
-		fiber_t* f = (fiber_t*)slist_pop_front(queue);
-		if (f) {
-			TC_ASSERT(f->job);
-			tc_fiber_ready(f);
-			return;
+	// The submitting fiber can move to another worker while yielding so always look it up again
+	worker_t* c = worker();
+	while (!job_try_push(c, job)) {
+		// Only fibers can give way to the job, scheduler fibers and threads outside the pool spill it
+		bool on_fiber = c && c->curr_fiber != &c->sched;
+		if (on_fiber && context->backpressure == BACKPRESSURE_YIELD) {
+			fiber_reschedule();
+			c = worker();
+			continue;
 		}
+		// Spill when all stacks big enough are in use as well, a finishing fiber picks it up from there
+		if (!on_fiber || (!job_skip(job) && !job_run_now(c, job))) {
+			job_spill(job);
+			worker_wake_any();
+		}
+		return;
 	}
 }
 
-static void queue_notify_all(slist_t* queue)
+/** Queues an array of jobs, every run of jobs with the same priority takes one reservation per queue */
+static void job_push_n(job_t* jobs, uint32_t count)
 {
-	while (!slist_empty(queue)) {
-		fiber_t* f = (fiber_t*)slist_pop_front(queue);
-		if (f) {
-			TC_ASSERT(f->job);
-			tc_fiber_ready(f);
+	void* batch[FIBER_PUSH_BATCH];
+	uint32_t i = 0;
+	while (i < count) {
+		jobpriority_t p = jobs[i].priority;
+		size_t n = 0;
+		while (i + n < count && n < FIBER_PUSH_BATCH && jobs[i + n].priority == p) {
+			batch[n] = &jobs[i + n];
+			n++;
+		}
+		i += (uint32_t)n;
+		// Same order as job_try_push, our own deque first and then the shared queue
+		worker_t* c = worker();
+		size_t queued = c ? ws_deque_push_n(c->deque[p], batch, n) : 0;
+		// The shared queue takes the cells that are free right now, retry while it keeps taking some
+		while (queued < n) {
+			size_t put = lf_queue_put_n(context->job_queue[p], batch + queued, n - queued);
+			if (put == 0)
+				break;
+			queued += put;
 		}
+		// Wake up as many parked workers as there are new jobs
+		for (size_t k = 0; k < queued && k < context->num_cords; k++) {
+			worker_wake_any();
+			if (atomic_load_explicit(&context->num_parked, memory_order_relaxed) == 0)
+				break;
+		}
+		// Both queues are full, the rest goes through the backpressure policy one by one
+		for (; queued < n; queued++)
+			job_push(batch[queued]);
 	}
 }
 
-static bool channel_full(tc_channel_t* c)
+/** Job running on the current fiber or NULL */
+static job_t* job_current()
 {
-	return c->tail == ((c->head + 1) % c->cap);
+	worker_t* c = worker();
+	if (c && c->curr_fiber != &c->sched)
+		return (job_t*)c->curr_fiber->job;
+	return NULL;
 }
 
-static bool channel_empty(tc_channel_t* c)
+static void job_destroy(jobrequest_t* req)
 {
-	return c->tail == c->head;
+	worker_t* w = worker();
+	uint32_t cls = job_request_class(req->num_jobs);
+	if (!w || cls >= FIBER_REQUEST_CLASSES || !magazine_push(&w->requests[cls], req))
+		TC_FREE(context->a, req, job_request_size(req->num_jobs));
 }
 
-static int64_t _channel_get(void* arg)
+static void job_clear_recycled(worker_t* c)
 {
-	tc_channel_t* c = arg;
-	fiber_t* f = tc_fiber();
-	for (;;) {
-		TC_LOCK(&c->lock);
-		if (c->closed) {
-			TC_UNLOCK(&c->lock);
-			return false;
-		}
-		if (channel_empty(c)) {
-			slist_add_tail(&c->consumers, f);
-			tc_fiber_yield(&c->lock);
-			TC_ASSERT(f->job);
-		}
-		else {
-			void** slots = (void**)(c + 1);
-			void* data = slots[c->tail];
-			c->tail = (c->tail + 1) % c->cap;
-			queue_notify_one(&c->producers);
-			TC_UNLOCK(&c->lock);
-			return data;
+	magazine_clear(&c->futures, sizeof(fut_t));
+	magazine_clear(&c->timers, sizeof(fibertimer_t));
+	for (int i = 0; i < FIBER_REQUEST_CLASSES; i++)
+		magazine_clear(&c->requests[i], job_request_size((size_t)1 << i));
+}
+
+static void job_finish(job_t* job, int64_t result)
+{
+	// If we have an output array place the result in there
+	if (job->req->result_ptr)
+		job->req->result_ptr[job->id] = result;
+	// Also place the result in the future result (overwriting previous results unless a job was cancelled)
+	if (job->req->results != TC_CANCELLED)
+		job->req->results = result;
+	// Exactly one job takes the count to zero, it finalizes before its decrement can wake waiters
+	if (job->req->complete && atomic_fetch_sub(&job->req->outstanding, 1) == 1)
+		job->req->complete(job->req);
+	// Decrement atomic counter to signal job is done
+	tc_fut_decr(job->future);
+}
+
+static bool job_skip(job_t* job)
+{
+	if (!tc_cancel_requested(job->cancel))
+		return false;
+	// Let the request release what the job would have released, like graph successors
+	if (job->req->skip)
+		job->req->skip(job);
+	job_finish(job, TC_CANCELLED);
+	return true;
+}
+
+static job_t* job_steal(worker_t* c, jobpriority_t p)
+{
+	job_t* job = NULL;
+	size_t n = context->num_workers;
+	size_t start = worker_rand(c) % n;
+	for (int pass = 0; pass < 2; pass++) {
+		for (size_t i = 0; i < n; i++) {
+			worker_t* victim = context->workers[(start + i) % n];
+			if (!worker_steal_from(c, victim, pass) || ws_deque_is_empty(victim->deque[p]))
+				continue;
+			if (ws_deque_steal(victim->deque[p], (void**)&job))
+				return job;
 		}
 	}
+	return NULL;
 }
 
-fut_t* tc_chan_get(tc_channel_t* channel)
+static job_t* job_next_priority(worker_t* c, jobpriority_t p)
 {
-	return tc_run_jobs(&(jobdecl_t) { .func = _channel_get, .data = channel }, 1, NULL);
+	job_t* job = NULL;
+	if (ws_deque_pop(c->deque[p], (void**)&job))
+		return job;
+	if (lf_queue_get(context->job_queue[p], (void**)&job))
+		return job;
+	job = job_unspill(p);
+	if (job)
+		return job;
+	return job_steal(c, p);
 }
 
-bool tc_chan_try_get(tc_channel_t* c, void** value)
+static job_t* job_next(worker_t* c)
 {
-	TC_LOCK(&c->lock);
-	if (c->closed) {
-		TC_UNLOCK(&c->lock);
-		return false;
+	static const jobpriority_t order[] = { JOB_PRIORITY_CRITICAL, JOB_PRIORITY_NORMAL, JOB_PRIORITY_BACKGROUND };
+	job_t* job = NULL;
+	// Give background jobs a turn every so often so they can not be starved forever
+	if (c->starvation >= FIBER_STARVATION_LIMIT) {
+		c->starvation = 0;
+		job = job_next_priority(c, JOB_PRIORITY_BACKGROUND);
+		if (job)
+			return job;
 	}
-	if (channel_empty(c)) {
-		TC_UNLOCK(&c->lock);
-		return false;
+	for (int i = 0; i < TC_COUNT(order); i++) {
+		job = job_next_priority(c, order[i]);
+		if (job) {
+			if (job->priority == JOB_PRIORITY_BACKGROUND)
+				c->starvation = 0;
+			else
+				c->starvation++;
+			return job;
+		}
 	}
-	void** slots = (void**)(c + 1);
-	*value = slots[c->tail];
-	c->tail = (c->tail + 1) % c->cap;
-	queue_notify_one(&c->producers);
-	TC_UNLOCK(&c->lock);
-	return true;
+	return NULL;
 }
 
-static int64_t _channel_put(void* arg)
+/*==========================================================*/
+/*						PARALLEL FOR						*/
+/*==========================================================*/
+
+typedef struct range_job_s {
+	job_t job;
+	size_t begin;
+	size_t end;
+	// Next split off range owned by the same loop
+	struct range_job_s* next;
+} range_job_t;
+
+typedef struct {
+	jobrequest_t;
+	range_func func;
+	void* ctx;
+	size_t grain;
+	fut_t* future;
+	// Ranges that were split off while running, freed with the loop
+	atomic_t splits;
+	range_job_t first;
+	// Size of the allocation holding the loop
+	size_t size;
+	// Ranges run with the priority, stack class and token of the job that started the loop
+	jobpriority_t priority;
+	fiberstack_t stack;
+	tc_cancel_t* cancel;
+} parallel_for_t;
+
+static int64_t parallel_for_run(void* arg);
+
+static void parallel_for_destroy(parallel_for_t* loop)
 {
-	tc_put_t* put_data = arg;
-	tc_channel_t* c = put_data->channel;
-	fiber_t* f = tc_fiber();
-	for (;;) {
-		TC_LOCK(&c->lock);
-		if (c->closed) {
-			TC_UNLOCK(&c->lock);
-			return 0;
-		}
-		if (channel_full(c)) {
-			slist_add_tail(&c->producers, f);
-			tc_fiber_yield(&c->lock);
-			TC_ASSERT(f->job);
+	range_job_t* r = (range_job_t*)atomic_load(&loop->splits);
+	while (r) {
+		range_job_t* next = r->next;
+		TC_FREE(context->a, r, sizeof(range_job_t));
+		r = next;
+	}
+	TC_FREE(context->a, loop, loop->size);
+}
+
+static void parallel_for_push(parallel_for_t* loop, range_job_t* r, size_t begin, size_t end)
+{
+	r->job.func = parallel_for_run;
+	r->job.data = r;
+	r->job.future = loop->future;
+	r->job.id = 0;
+	r->job.req = (jobrequest_t*)loop;
+	r->job.next = NULL;
+	r->job.priority = loop->priority;
+	r->job.stack = loop->stack;
+	r->job.cancel = loop->cancel;
+	r->begin = begin;
+	r->end = end;
+	job_push(&r->job);
+}
+
+static void parallel_for_split(parallel_for_t* loop, size_t begin, size_t end)
+{
+	range_job_t* r = TC_ALLOC(context->a, sizeof(range_job_t));
+	size_t head = atomic_load(&loop->splits);
+	do {
+		r->next = (range_job_t*)head;
+	} while (!CAS(&loop->splits, head, r));
+	// Count the new job before it can run so the loop never completes early
+	atomic_fetch_add(&loop->outstanding, 1);
+	tc_fut_incr(loop->future);
+	parallel_for_push(loop, r, begin, end);
+}
+
+static int64_t parallel_for_run(void* arg)
+{
+	range_job_t* r = arg;
+	parallel_for_t* loop = (parallel_for_t*)r->job.req;
+	worker_t* c = worker();
+	size_t begin = r->begin;
+	size_t end = r->end;
+	while (end - begin > loop->grain) {
+		if (tc_cancel_requested(loop->cancel))
+			return TC_CANCELLED;
+		// Only split when our deque is empty, otherwise idle workers already have something to steal
+		if (ws_deque_is_empty(c->deque[loop->priority])) {
+			size_t mid = begin + (end - begin) / 2;
+			parallel_for_split(loop, mid, end);
+			end = mid;
 		}
 		else {
-			void** slots = (void**)(c + 1);
-			slots[c->head] = put_data->value;
-			c->head = (c->head + 1) % c->cap;
-			queue_notify_one(&c->consumers);
-			TC_UNLOCK(&c->lock);
-			return 1;
+			loop->func(loop->ctx, begin, begin + loop->grain);
+			begin += loop->grain;
 		}
+		// A job can move to another worker when the loop body yields
+		c = worker();
 	}
+	if (begin < end)
+		loop->func(loop->ctx, begin, end);
+	return 0;
 }
 
-fut_t* tc_chan_put(tc_put_t* put_data)
+static parallel_for_t* parallel_for_new(size_t size, range_func func, void* ctx)
 {
-	return tc_run_jobs(&(jobdecl_t) { .func = _channel_put, .data = put_data }, 1, NULL);
+	parallel_for_t* loop = TC_ALLOC(context->a, size);
+	memset(loop, 0, size);
+	loop->instance = loop;
+	loop->dtor = parallel_for_destroy;
+	loop->func = func;
+	loop->ctx = ctx;
+	loop->size = size;
+	job_t* parent = job_current();
+	loop->priority = parent ? parent->priority : JOB_PRIORITY_NORMAL;
+	loop->stack = parent ? parent->stack : FIBER_STACK_SMALL;
+	loop->cancel = parent ? parent->cancel : NULL;
+	return loop;
 }
 
-bool tc_chan_try_put(tc_put_t* put_data)
+static fut_t* parallel_for_start(parallel_for_t* loop, size_t begin, size_t end, size_t grain)
 {
-	tc_channel_t* c = put_data->channel;
-	TC_LOCK(&c->lock);
-	if (c->closed) {
-		TC_UNLOCK(&c->lock);
-		return false;
-	}
-	if (channel_full(c)) {
-		TC_UNLOCK(&c->lock);
-		return false;
-	}
-	void** slots = (void**)(c + 1);
-	slots[c->head] = put_data->value;
-	c->head = (c->head + 1) % c->cap;
-	queue_notify_one(&c->consumers);
-	TC_UNLOCK(&c->lock);
-	return true;
+	size_t count = end > begin ? end - begin : 0;
+	if (grain == 0)
+		grain = count / (context->num_cords * FIBER_SPLIT_FACTOR);
+	loop->grain = grain ? grain : 1;
+	// The whole range starts as a single job, it gets split up as workers steal from it
+	atomic_init(&loop->outstanding, count ? 1 : 0);
+	loop->future = tc_fut_new(context->a, count ? 1 : 0, loop);
+	if (count)
+		parallel_for_push(loop, &loop->first, begin, end);
+	else if (loop->complete)
+		loop->complete((jobrequest_t*)loop);
+	return loop->future;
 }
 
-tc_channel_t* tc_chan_new(tc_allocator_i* a, uint32_t num_slots)
+fut_t* tc_parallel_for(size_t begin, size_t end, size_t grain, range_func func, void* ctx)
 {
-	tc_channel_t* c = TC_ALLOC(a, sizeof(tc_channel_t) + num_slots * sizeof(void*));
-	memset(c, 0, sizeof(tc_channel_t) + num_slots * sizeof(void*));
-	c->base = a;
-	c->cap = num_slots;
-	slist_init(&c->consumers);
-	slist_init(&c->producers);
-	return c;
+	parallel_for_t* loop = parallel_for_new(sizeof(parallel_for_t), func, ctx);
+	return parallel_for_start(loop, begin, end, grain);
 }
 
-void tc_chan_close(tc_channel_t* c)
+typedef struct {
+	parallel_for_t;
+	reducedesc_t desc;
+	// Distance between the partial accumulators of two workers
+	size_t stride;
+	// Cache line aligned accumulator per worker
+	char* partials;
+} parallel_reduce_t;
+
+static void parallel_reduce_run(void* arg, size_t begin, size_t end)
 {
-	TC_LOCK(&c->lock);
-	if (!c->closed) {
-		c->closed = true;
-		queue_notify_all(&c->producers);
-		queue_notify_all(&c->consumers);
+	parallel_reduce_t* red = arg;
+	char* acc = red->partials + worker()->id * red->stride;
+	red->desc.func(red->desc.ctx, acc, begin, end);
+}
+
+static void parallel_reduce_complete(jobrequest_t* req)
+{
+	parallel_reduce_t* red = (parallel_reduce_t*)req;
+	memcpy(red->desc.result, red->desc.identity, red->desc.size);
+	for (size_t i = 0; i < context->num_workers; i++)
+		red->desc.combine(red->desc.ctx, red->desc.result, red->partials + i * red->stride);
+}
+
+fut_t* tc_parallel_reduce(const reducedesc_t* desc)
+{
+	size_t stride = (desc->size + FIBER_CACHE_LINE - 1) & ~(size_t)(FIBER_CACHE_LINE - 1);
+	size_t size = sizeof(parallel_reduce_t) + FIBER_CACHE_LINE + context->num_workers * stride;
+	parallel_reduce_t* red = (parallel_reduce_t*)parallel_for_new(size, parallel_reduce_run, NULL);
+	red->ctx = red;
+	red->complete = parallel_reduce_complete;
+	red->desc = *desc;
+	red->stride = stride;
+	red->partials = (char*)(((size_t)(red + 1) + FIBER_CACHE_LINE - 1) & ~(size_t)(FIBER_CACHE_LINE - 1));
+	for (size_t i = 0; i < context->num_workers; i++)
+		memcpy(red->partials + i * stride, desc->identity, desc->size);
+	return parallel_for_start((parallel_for_t*)red, desc->begin, desc->end, desc->grain);
+}
+
+
+/*==========================================================*/
+/*						TASK GRAPHS							*/
+/*==========================================================*/
+
+typedef struct {
+	uint32_t node;
+	uint32_t dependency;
+} graphedge_t;
+
+typedef struct tc_graph_s {
+	tc_allocator_i* a;
+	// Jobs of the nodes in the order they were added
+	jobdecl_t* nodes;
+	uint32_t num_nodes;
+	uint32_t cap_nodes;
+	// Dependency edges as they were declared
+	graphedge_t* edges;
+	uint32_t num_edges;
+	uint32_t cap_edges;
+	// Successors of node i are successors[offsets[i]] up to successors[offsets[i + 1]]
+	uint32_t* offsets;
+	uint32_t* successors;
+	// Number of dependencies per node
+	uint32_t* num_deps;
+	// Nodes without dependencies that are started by every run
+	uint32_t* roots;
+	uint32_t num_roots;
+	// Set by tc_graph_compile and cleared when the graph is changed
+	bool compiled;
+} tc_graph_t;
+
+typedef struct {
+	jobrequest_t;
+	tc_graph_t* graph;
+	// Number of unfinished dependencies per node, a node is pushed when its count hits zero
+	atomic_t* pending;
+	// Job per node with its node index as id
+	job_t* jobs;
+	// Size of the allocation holding the run
+	size_t size;
+} graphrun_t;
+
+static void graph_compiled_free(tc_graph_t* g)
+{
+	if (!g->compiled)
+		return;
+	TC_FREE(g->a, g->offsets, (g->num_nodes + 1) * sizeof(uint32_t));
+	TC_FREE(g->a, g->successors, g->num_edges * sizeof(uint32_t));
+	TC_FREE(g->a, g->num_deps, g->num_nodes * sizeof(uint32_t));
+	TC_FREE(g->a, g->roots, g->num_nodes * sizeof(uint32_t));
+	g->compiled = false;
+}
+
+static void graph_run_destroy(graphrun_t* run)
+{
+	TC_FREE(run->graph->a, run, run->size);
+}
+
+/** Publishes the result of a node and pushes the successors that have no other unfinished dependencies */
+static void graph_node_release(job_t* job, int64_t result)
+{
+	graphrun_t* run = (graphrun_t*)job->req;
+	tc_graph_t* g = run->graph;
+	// Successors can read the result as soon as they are pushed, job_finish writes the same value again
+	if (run->result_ptr)
+		run->result_ptr[job->id] = result;
+	// Release successors before this job counts as finished so the run can not complete early
+	for (uint32_t i = g->offsets[job->id]; i < g->offsets[job->id + 1]; i++) {
+		uint32_t succ = g->successors[i];
+		if (atomic_fetch_sub(&run->pending[succ], 1) == 1)
+			job_push(&run->jobs[succ]);
 	}
-	TC_UNLOCK(&c->lock);
 }
 
-void tc_chan_destroy(tc_channel_t* c)
+static int64_t graph_node_run(void* arg)
 {
+	job_t* job = arg;
+	graphrun_t* run = (graphrun_t*)job->req;
+	tc_graph_t* g = run->graph;
+	jobdecl_t* node = &g->nodes[job->id];
+	int64_t result = node->func(node->data);
+	graph_node_release(job, result);
+	return result;
+}
+
+static void graph_node_skip(job_t* job)
+{
+	graph_node_release(job, TC_CANCELLED);
+}
+
+tc_graph_t* tc_graph_new(tc_allocator_i* a)
+{
+	tc_graph_t* g = TC_ALLOC(a, sizeof(tc_graph_t));
+	memset(g, 0, sizeof(tc_graph_t));
+	g->a = a;
+	return g;
+}
+
+uint32_t tc_graph_add(tc_graph_t* g, jobdecl_t job)
+{
+	TC_ASSERT(job.func);
+	TC_ASSERT(job.priority < JOB_PRIORITY_COUNT);
+	TC_ASSERT(job.stack < FIBER_STACK_COUNT);
+	graph_compiled_free(g);
+	if (g->num_nodes == g->cap_nodes) {
+		uint32_t cap = g->cap_nodes ? g->cap_nodes * 2 : 16;
+		g->nodes = TC_REALLOC(g->a, g->nodes, g->cap_nodes * sizeof(jobdecl_t), cap * sizeof(jobdecl_t));
+		g->cap_nodes = cap;
+	}
+	g->nodes[g->num_nodes] = job;
+	return g->num_nodes++;
+}
+
+void tc_graph_depend(tc_graph_t* g, uint32_t node, uint32_t dependency)
+{
+	TC_ASSERT(node < g->num_nodes && dependency < g->num_nodes && node != dependency);
+	graph_compiled_free(g);
+	if (g->num_edges == g->cap_edges) {
+		uint32_t cap = g->cap_edges ? g->cap_edges * 2 : 16;
+		g->edges = TC_REALLOC(g->a, g->edges, g->cap_edges * sizeof(graphedge_t), cap * sizeof(graphedge_t));
+		g->cap_edges = cap;
+	}
+	g->edges[g->num_edges++] = (graphedge_t){ node, dependency };
+}
+
+void tc_graph_compile(tc_graph_t* g)
+{
+	graph_compiled_free(g);
+	uint32_t n = g->num_nodes;
+	g->offsets = TC_CALLOC(g->a, (n + 1), sizeof(uint32_t));
+	g->successors = TC_ALLOC(g->a, g->num_edges * sizeof(uint32_t));
+	g->num_deps = TC_CALLOC(g->a, n, sizeof(uint32_t));
+	g->roots = TC_ALLOC(g->a, n * sizeof(uint32_t));
+	g->compiled = true;
+	// Count successors per node and prefix sum them into offsets
+	for (uint32_t i = 0; i < g->num_edges; i++) {
+		g->offsets[g->edges[i].dependency + 1]++;
+		g->num_deps[g->edges[i].node]++;
+	}
+	for (uint32_t i = 0; i < n; i++)
+		g->offsets[i + 1] += g->offsets[i];
+	// Fill in successors, using roots as the insert position per node for now
+	memcpy(g->roots, g->offsets, n * sizeof(uint32_t));
+	for (uint32_t i = 0; i < g->num_edges; i++)
+		g->successors[g->roots[g->edges[i].dependency]++] = g->edges[i].node;
+	g->num_roots = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		if (g->num_deps[i] == 0)
+			g->roots[g->num_roots++] = i;
+	}
+#ifndef NDEBUG
+	// Every node has to be reachable from the roots, otherwise there is a cycle
+	uint32_t* deps = TC_ALLOC(g->a, n * sizeof(uint32_t));
+	uint32_t* order = TC_ALLOC(g->a, n * sizeof(uint32_t));
+	memcpy(deps, g->num_deps, n * sizeof(uint32_t));
+	memcpy(order, g->roots, g->num_roots * sizeof(uint32_t));
+	uint32_t visited = g->num_roots;
+	for (uint32_t i = 0; i < visited; i++) {
+		for (uint32_t j = g->offsets[order[i]]; j < g->offsets[order[i] + 1]; j++) {
+			if (--deps[g->successors[j]] == 0)
+				order[visited++] = g->successors[j];
+		}
+	}
+	TC_ASSERT(visited == n);
+	TC_FREE(g->a, deps, n * sizeof(uint32_t));
+	TC_FREE(g->a, order, n * sizeof(uint32_t));
+#endif
+}
+
+fut_t* tc_graph_run(tc_graph_t* g, int64_t* results, tc_cancel_t* cancel)
+{
+	TC_ASSERT(g->compiled);
+	uint32_t n = g->num_nodes;
+	size_t size = sizeof(graphrun_t) + n * (sizeof(job_t) + sizeof(atomic_t));
+	graphrun_t* run = TC_ALLOC(g->a, size);
+	memset(run, 0, sizeof(graphrun_t));
+	run->instance = run;
+	run->dtor = graph_run_destroy;
+	run->num_jobs = n;
+	run->result_ptr = results;
+	// Successors of skipped nodes are released so the whole run drains as cancelled
+	run->skip = graph_node_skip;
+	run->graph = g;
+	run->size = size;
+	run->jobs = (job_t*)(run + 1);
+	run->pending = (atomic_t*)(run->jobs + n);
+	fut_t* future = tc_fut_new(g->a, n, run);
+	// All nodes are set up before the first root runs and starts releasing successors
+	for (uint32_t i = 0; i < n; i++) {
+		job_t* job = &run->jobs[i];
+		job->func = graph_node_run;
+		job->data = job;
+		job->future = future;
+		job->id = i;
+		job->req = (jobrequest_t*)run;
+		job->next = NULL;
+		job->priority = g->nodes[i].priority;
+		job->stack = g->nodes[i].stack;
+		job->cancel = cancel ? cancel : g->nodes[i].cancel;
+		atomic_init(&run->pending[i], g->num_deps[i]);
+	}
+	for (uint32_t i = 0; i < g->num_roots; i++)
+		job_push(&run->jobs[g->roots[i]]);
+	return future;
+}
+
+void tc_graph_destroy(tc_graph_t* g)
+{
+	graph_compiled_free(g);
+	if (g->nodes)
+		TC_FREE(g->a, g->nodes, g->cap_nodes * sizeof(jobdecl_t));
+	if (g->edges)
+		TC_FREE(g->a, g->edges, g->cap_edges * sizeof(graphedge_t));
+	TC_FREE(g->a, g, sizeof(tc_graph_t));
+}
+
+
+/*==========================================================*/
+/*						CANCELLATION						*/
+/*==========================================================*/
+
+struct tc_cancel_s {
+	tc_allocator_i* a;
+	atomic_t cancelled;
+	// Time (uv_hrtime) after which the token counts as cancelled, 0 for no deadline
+	uint64_t deadline;
+};
+
+tc_cancel_t* tc_cancel_new(tc_allocator_i* a, uint64_t timeout)
+{
+	tc_cancel_t* token = TC_ALLOC(a, sizeof(tc_cancel_t));
+	token->a = a;
+	atomic_init(&token->cancelled, 0);
+	token->deadline = timeout ? uv_hrtime() + timeout * 1000000 : 0;
+	return token;
+}
+
+void tc_cancel(tc_cancel_t* token)
+{
+	atomic_store_explicit(&token->cancelled, 1, memory_order_release);
+}
+
+bool tc_cancel_requested(tc_cancel_t* token)
+{
+	if (!token)
+		return false;
+	if (atomic_load_explicit(&token->cancelled, memory_order_acquire))
+		return true;
+	// Deadlines are checked when the token is looked at so no timer has to be kept alive for it
+	if (token->deadline && uv_hrtime() >= token->deadline) {
+		tc_cancel(token);
+		return true;
+	}
+	return false;
+}
+
+bool tc_job_cancelled()
+{
+	job_t* job = job_current();
+	return job && tc_cancel_requested(job->cancel);
+}
+
+void tc_cancel_free(tc_cancel_t* token)
+{
+	TC_FREE(token->a, token, sizeof(tc_cancel_t));
+}
+
+
+/*==========================================================*/
+/*							TIMERS							*/
+/*==========================================================*/
+
+/** Current time in ticks, shared by all workers */
+static uint64_t timer_tick() { return uv_hrtime() / (1000000 * FIBER_TIMER_TICK); }
+
+/**
+ * Puts a timer in the slot of the level that covers the ticks until it expires,
+ * base is the first tick that is not processed yet. Timers that are already due fire on that tick.
+ */
+static void timer_place(timerwheel_t* w, fibertimer_t* t, uint64_t base)
+{
+	uint64_t expires = t->expires > base ? t->expires : base;
+	uint64_t delta = expires - base;
+	int level = 0;
+	while (level < FIBER_TIMER_LEVELS - 1 && delta >= (uint64_t)1 << (FIBER_TIMER_BITS * (level + 1)))
+		level++;
+	// Too far ahead for the wheel, it is placed again when its slot comes around
+	if (delta >= (uint64_t)1 << (FIBER_TIMER_BITS * FIBER_TIMER_LEVELS))
+		expires = base + ((uint64_t)1 << (FIBER_TIMER_BITS * FIBER_TIMER_LEVELS)) - 1;
+	fibertimer_t** slot = &w->slots[level][(expires >> (FIBER_TIMER_BITS * level)) & (FIBER_TIMER_SLOTS - 1)];
+	t->next = *slot;
+	t->prev = slot;
+	if (t->next)
+		t->next->prev = &t->next;
+	*slot = t;
+	t->state = TIMER_PENDING;
+}
+
+static void timer_unlink(fibertimer_t* t)
+{
+	*t->prev = t->next;
+	if (t->next)
+		t->next->prev = t->prev;
+	t->next = NULL;
+	t->prev = NULL;
+}
+
+/** First tick at which a slot needs to be fired or moved to a lower level */
+static uint64_t timer_next(timerwheel_t* w)
+{
+	uint64_t next = UINT64_MAX;
+	for (int level = 0; level < FIBER_TIMER_LEVELS; level++) {
+		int shift = FIBER_TIMER_BITS * level;
+		for (uint64_t i = 1; i <= FIBER_TIMER_SLOTS; i++) {
+			uint64_t block = (w->now >> shift) + i;
+			if (w->slots[level][block & (FIBER_TIMER_SLOTS - 1)]) {
+				if ((block << shift) < next)
+					next = block << shift;
+				break;
+			}
+		}
+	}
+	return next;
+}
+
+static void timer_wheel_cb(uv_timer_t* handle);
+
+/** Sets the event loop timer to the next tick that has work, called with the wheel lock held */
+static void timer_arm(timerwheel_t* w)
+{
+	uint64_t next = w->count ? timer_next(w) : UINT64_MAX;
+	if (next == w->armed)
+		return;
+	w->armed = next;
+	if (next == UINT64_MAX) {
+		uv_timer_stop(&w->handle);
+		return;
+	}
+	uint64_t now = timer_tick();
+	uv_timer_start(&w->handle, timer_wheel_cb, next > now ? (next - now) * FIBER_TIMER_TICK : 0, 0);
+}
+
+static void timer_free(fibertimer_t* t)
+{
+	worker_t* c = worker();
+	if (!c || !magazine_push(&c->timers, t))
+		TC_FREE(context->a, t, sizeof(fibertimer_t));
+}
+
+/** Processes every tick up to now, timers that expire are returned in a list */
+static fibertimer_t* timer_advance(timerwheel_t* w, uint64_t now)
+{
+	fibertimer_t* expired = NULL;
+	// Nothing to fire on the way so skip ahead
+	if (w->count == 0 && now > w->now)
+		w->now = now;
+	while (w->now < now) {
+		uint64_t tick = w->now + 1;
+		// Move timers of higher levels down when we enter their slot, highest level first
+		int level = 1;
+		while (level < FIBER_TIMER_LEVELS && (tick & (((uint64_t)1 << (FIBER_TIMER_BITS * level)) - 1)) == 0)
+			level++;
+		while (--level > 0) {
+			fibertimer_t** slot = &w->slots[level][(tick >> (FIBER_TIMER_BITS * level)) & (FIBER_TIMER_SLOTS - 1)];
+			fibertimer_t* t = *slot;
+			*slot = NULL;
+			while (t) {
+				fibertimer_t* next = t->next;
+				// Relative to the tick we enter, otherwise timers on the last tick of the block go back into this slot
+				timer_place(w, t, tick);
+				t = next;
+			}
+		}
+		w->now = tick;
+		fibertimer_t** slot = &w->slots[0][tick & (FIBER_TIMER_SLOTS - 1)];
+		while (*slot) {
+			fibertimer_t* t = *slot;
+			timer_unlink(t);
+			t->state = TIMER_FIRING;
+			t->next = expired;
+			expired = t;
+			w->count--;
+		}
+	}
+	return expired;
+}
+
+static void timer_wheel_cb(uv_timer_t* handle)
+{
+	timerwheel_t* w = (timerwheel_t*)handle->data;
+	TC_LOCK(&w->lock);
+	w->armed = UINT64_MAX;
+	fibertimer_t* t = timer_advance(w, timer_tick());
+	TC_UNLOCK(&w->lock);
+	// Futures are decremented without the lock so woken jobs can cancel other timers of this wheel
+	while (t) {
+		fibertimer_t* next = t->next;
+		tc_fut_decr(t->future);
+		TC_LOCK(&w->lock);
+		if (t->state == TIMER_CANCELLED) {
+			TC_UNLOCK(&w->lock);
+			timer_free(t);
+		}
+		else {
+			if (--t->repeats) {
+				t->expires += t->interval;
+				timer_place(w, t, w->now + 1);
+				w->count++;
+			}
+			else
+				t->state = TIMER_DONE;
+			TC_UNLOCK(&w->lock);
+		}
+		t = next;
+	}
+	TC_LOCK(&w->lock);
+	timer_arm(w);
+	TC_UNLOCK(&w->lock);
+}
+
+static void timer_rearm(worker_t* c)
+{
+	timerwheel_t* w = &c->wheel;
+	if (!w->rearm)
+		return;
+	TC_LOCK(&w->lock);
+	w->rearm = false;
+	timer_arm(w);
+	TC_UNLOCK(&w->lock);
+}
+
+static void timer_wheel_init(worker_t* c)
+{
+	timerwheel_t* w = &c->wheel;
+	spin_lock_init(&w->lock);
+	w->now = timer_tick();
+	w->armed = UINT64_MAX;
+	uv_timer_init(&c->loop, &w->handle);
+	w->handle.data = w;
+}
+
+#ifndef NDEBUG
+static void timer_wheel_check()
+{
+	// Last ticks of level 1 and level 2 blocks, these are moved down while the wheel enters their block
+	static const uint64_t expires[] = {
+		1 * FIBER_TIMER_SLOTS - 1, 21 * FIBER_TIMER_SLOTS - 1,
+		1 * FIBER_TIMER_SLOTS * FIBER_TIMER_SLOTS - 1, 2 * FIBER_TIMER_SLOTS * FIBER_TIMER_SLOTS - 1,
+	};
+	timerwheel_t w;
+	fibertimer_t t;
+	for (int i = 0; i < TC_COUNT(expires); i++) {
+		memset(&w, 0, sizeof(timerwheel_t));
+		memset(&t, 0, sizeof(fibertimer_t));
+		t.expires = expires[i];
+		timer_place(&w, &t, w.now + 1);
+		w.count = 1;
+		for (uint64_t tick = 1; tick <= expires[i]; tick++) {
+			fibertimer_t* fired = timer_advance(&w, tick);
+			TC_ASSERT((fired == &t) == (tick == expires[i]));
+		}
+	}
+}
+#endif
+
+/** Called when the future of the timer is freed, takes the timer out of the wheel if it did not finish */
+static void timer_cancel(fibertimer_t* t)
+{
+	worker_t* owner = context->workers[t->worker];
+	timerwheel_t* w = &owner->wheel;
+	TC_LOCK(&w->lock);
+	while (t->state == TIMER_FIRING) {
+		// Freed by a job that ran inside the expiry, the owner frees the timer when it is done with it
+		if (worker() == owner) {
+			t->state = TIMER_CANCELLED;
+			TC_UNLOCK(&w->lock);
+			return;
+		}
+		// The owner still decrements the future, wait until it let go of it
+		TC_UNLOCK(&w->lock);
+		pause();
+		TC_LOCK(&w->lock);
+	}
+	if (t->state == TIMER_PENDING) {
+		timer_unlink(t);
+		w->count--;
+	}
+	TC_UNLOCK(&w->lock);
+	timer_free(t);
+}
+
+fut_t* tc_timer_start(uint64_t timeout, uint64_t repeats)
+{
+	if (repeats) {
+		worker_t* c = worker();
+		TC_ASSERT(c);
+		fibertimer_t* t = magazine_pop(&c->timers);
+		if (!t)
+			t = TC_ALLOC(context->a, sizeof(fibertimer_t));
+		// Guest slots stop running their event loop when the thread is done waiting, use a worker thread
+		worker_t* owner = c->id < (int)context->num_cords ? c : context->workers[context->num_cords - 1];
+		memset(t, 0, sizeof(fibertimer_t));
+		// Round up so timers never fire early, the current tick already started so it does not count
+		t->interval = (timeout + FIBER_TIMER_TICK - 1) / FIBER_TIMER_TICK;
+		if (t->interval == 0)
+			t->interval = 1;
+		t->expires = timer_tick() + t->interval + 1;
+		t->repeats = repeats;
+		t->worker = owner->id;
+		t->instance = t;
+		t->dtor = timer_cancel;
+		t->future = tc_fut_new(context->a, repeats, t);
+		timerwheel_t* w = &owner->wheel;
+		TC_LOCK(&w->lock);
+		// The wheel does not advance while it is empty, catch up so the timer is placed relative to the current tick
+		if (w->count == 0 && timer_tick() > w->now)
+			w->now = timer_tick();
+		timer_place(w, t, w->now + 1);
+		w->count++;
+		bool rearm = t->expires < w->armed;
+		if (rearm && owner != c)
+			w->rearm = true;
+		else if (rearm)
+			timer_arm(w);
+		TC_UNLOCK(&w->lock);
+		if (rearm && owner != c)
+			uv_async_send(&owner->wakeup);
+		return t->future;
+	}
+	else return 0;
+}
+
+
+/*==========================================================*/
+/*							CHANNELS						*/
+/*==========================================================*/
+
+typedef struct tc_channel_s {
+	tc_allocator_i* base;
+	channelmode_t mode;
+	lock_t lock;
+	slist_t producers;
+	slist_t consumers;
+	uint32_t cap;
+	uint32_t head;
+	uint32_t tail;
+	atomic_t closed;
+	// Ring of the lock free modes, the lock is only used for the wait lists
+	lf_queue_t* queue;
+	spsc_queue_t* spsc;
+	// Number of fibers in the wait lists of the lock free modes
+	ALIGNED(atomic_t, 64) num_producers;
+	ALIGNED(atomic_t, 64) num_consumers;
+} tc_channel_t;
+
+
+typedef struct {
+	lifo_t;
+	// Fiber that waits for a value or for room in the channel
+	fiber_t* fiber;
+	// Value that is handed over directly between sender and receiver
+	void* value;
+	// Set when the value was handed over, stays false when the channel was closed
+	bool done;
+	// Select this waiter is part of, with the index of this channel
+	waitany_t* any;
+	uint32_t index;
+} chanwaiter_t;
+
+/**
+ * Pops the first waiter that can still be woken while holding the lock, waiters of a select
+ * that already received from another channel are dropped. Sets f to the fiber to resume after unlocking.
+ */
+static chanwaiter_t* channel_pop_waiter(slist_t* queue, atomic_t* num_waiting, fiber_t** f)
+{
+	chanwaiter_t* w;
+	while ((w = (chanwaiter_t*)slist_pop_front(queue))) {
+		if (num_waiting)
+			atomic_fetch_sub(num_waiting, 1);
+		if (!w->any) {
+			*f = w->fiber;
+			return w;
+		}
+		bool claimed;
+		*f = waitany_claim(w->any, w->index, &claimed);
+		if (claimed)
+			return w;
+	}
+	*f = NULL;
+	return NULL;
+}
+
+static void queue_notify_all(slist_t* queue)
+{
+	fiber_t* f;
+	while (channel_pop_waiter(queue, NULL, &f)) {
+		if (f)
+			fiber_handoff(f);
+	}
+}
+
+static bool channel_full(tc_channel_t* c)
+{
+	return c->tail == ((c->head + 1) % c->cap);
+}
+
+static bool channel_empty(tc_channel_t* c)
+{
+	return c->tail == c->head;
+}
+
+/** Channel has a value for a receiver, in the buffer or from a waiting sender */
+static bool channel_readable(tc_channel_t* c)
+{
+	return !channel_empty(c) || !slist_empty(&c->producers);
+}
+
+/** Channel can take a value, in the buffer or by a waiting receiver */
+static bool channel_writable(tc_channel_t* c)
+{
+	return !channel_full(c) || !slist_empty(&c->consumers);
+}
+
+/**
+ * Takes the oldest value while holding the lock, a sender that waits for room moves its value into the freed slot.
+ * Returns the fiber to resume after unlocking.
+ */
+static fiber_t* channel_take(tc_channel_t* c, void** value)
+{
+	void** slots = (void**)(c + 1);
+	fiber_t* f;
+	chanwaiter_t* w = channel_pop_waiter(&c->producers, NULL, &f);
+	if (channel_empty(c)) {
+		// Unbuffered channel, take the value straight from the sender
+		TC_ASSERT(w);
+		*value = w->value;
+	}
+	else {
+		*value = slots[c->tail];
+		c->tail = (c->tail + 1) % c->cap;
+		if (w) {
+			slots[c->head] = w->value;
+			c->head = (c->head + 1) % c->cap;
+		}
+	}
+	if (w)
+		w->done = true;
+	return f;
+}
+
+/**
+ * Gives a value to a waiting receiver or puts it in the buffer while holding the lock.
+ * Sets f to the fiber to resume after unlocking, returns false when the value did not fit.
+ */
+static bool channel_give(tc_channel_t* c, void* value, fiber_t** f)
+{
+	// Receivers only wait when the buffer is empty, so handing over directly keeps the order
+	chanwaiter_t* w = channel_pop_waiter(&c->consumers, NULL, f);
+	if (w) {
+		w->value = value;
+		w->done = true;
+		return true;
+	}
+	// The receivers that made the channel look writable were selects that already received elsewhere
+	if (channel_full(c))
+		return false;
+	void** slots = (void**)(c + 1);
+	slots[c->head] = value;
+	c->head = (c->head + 1) % c->cap;
+	return true;
+}
+
+static bool channel_lf_put(tc_channel_t* c, void* value)
+{
+	return c->mode == CHANNEL_SPSC ? spsc_queue_put(c->spsc, value) : lf_queue_put(c->queue, value);
+}
+
+static bool channel_lf_get(tc_channel_t* c, void** value)
+{
+	return c->mode == CHANNEL_SPSC ? spsc_queue_get(c->spsc, value) : lf_queue_get(c->queue, value);
+}
+
+static bool channel_lf_empty(tc_channel_t* c)
+{
+	return c->mode == CHANNEL_SPSC ? spsc_queue_is_empty(c->spsc) : lf_queue_is_empty(c->queue);
+}
+
+/** Removes a waiter from a wait list, returns false when it was not in there anymore */
+static bool channel_remove(slist_t* queue, lifo_t* node)
+{
+	lifo_t* prev = (lifo_t*)queue;
+	while (prev->next && prev->next != (void*)node)
+		prev = (lifo_t*)prev->next;
+	if (!prev->next)
+		return false;
+	prev->next = node->next;
+	if (queue->tail == node)
+		queue->tail = prev;
+	node->next = NULL;
+	return true;
+}
+
+/** Wakes up to count fibers of a wait list of a lock free channel after its ring changed */
+static void channel_notify(tc_channel_t* c, slist_t* queue, atomic_t* num_waiting, size_t count)
+{
+	// Pairs with the fence in channel_wait so either we see the waiter or it sees the change
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(num_waiting, memory_order_relaxed) == 0)
+		return;
+	fiber_t* wake[FIBER_WAKE_BATCH];
+	uint32_t num_wake = 0;
+	TC_LOCK(&c->lock);
+	for (size_t i = 0; i < count && num_wake < FIBER_WAKE_BATCH; i++) {
+		fiber_t* f;
+		if (!channel_pop_waiter(queue, num_waiting, &f))
+			break;
+		if (f)
+			wake[num_wake++] = f;
+	}
+	TC_UNLOCK(&c->lock);
+	for (uint32_t i = 0; i < num_wake; i++)
+		fiber_handoff(wake[i]);
+}
+
+/**
+ * Waits until a lock free channel changed or closed, unless retry succeeds right after joining the wait list.
+ * Returns true when retry succeeded.
+ */
+static bool channel_wait(tc_channel_t* c, slist_t* queue, atomic_t* num_waiting, bool (*retry)(tc_channel_t*, void**), void** value)
+{
+	chanwaiter_t w = { 0 };
+	w.fiber = tc_fiber();
+	TC_LOCK(&c->lock);
+	if (c->closed) {
+		TC_UNLOCK(&c->lock);
+		return false;
+	}
+	slist_add_tail(queue, (lifo_t*)&w);
+	atomic_fetch_add(num_waiting, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	// The other side could have made progress before it saw us waiting
+	if (retry(c, value)) {
+		channel_remove(queue, (lifo_t*)&w);
+		atomic_fetch_sub(num_waiting, 1);
+		TC_UNLOCK(&c->lock);
+		return true;
+	}
+	tc_fiber_yield(&c->lock);
+	return false;
+}
+
+static bool channel_lf_retry_put(tc_channel_t* c, void** value)
+{
+	return channel_lf_put(c, *value);
+}
+
+static bool channel_lf_recv(tc_channel_t* c, void** value)
+{
+	for (;;) {
+		if (channel_lf_get(c, value) ||
+			channel_wait(c, &c->consumers, &c->num_consumers, channel_lf_get, value)) {
+			channel_notify(c, &c->producers, &c->num_producers, 1);
+			return true;
+		}
+		// Values that were sent before the channel closed are still received
+		if (c->closed && channel_lf_empty(c))
+			return false;
+	}
+}
+
+static bool channel_lf_send(tc_channel_t* c, void* value)
+{
+	for (;;) {
+		if (c->closed)
+			return false;
+		if (channel_lf_put(c, value) ||
+			channel_wait(c, &c->producers, &c->num_producers, channel_lf_retry_put, &value)) {
+			channel_notify(c, &c->consumers, &c->num_consumers, 1);
+			return true;
+		}
+	}
+}
+
+bool tc_chan_recv(tc_channel_t* c, void** value)
+{
+	if (c->mode != CHANNEL_LOCKED)
+		return channel_lf_recv(c, value);
+	TC_LOCK(&c->lock);
+	// Values that were sent before the channel closed are still received
+	if (channel_readable(c)) {
+		fiber_t* f = channel_take(c, value);
+		TC_UNLOCK(&c->lock);
+		if (f)
+			fiber_handoff(f);
+		return true;
+	}
+	if (c->closed) {
+		TC_UNLOCK(&c->lock);
+		return false;
+	}
+	// Sleep until a sender hands us a value or the channel is closed
+	chanwaiter_t w = { 0 };
+	w.fiber = tc_fiber();
+	slist_add_tail(&c->consumers, (lifo_t*)&w);
+	tc_fiber_yield(&c->lock);
+	if (w.done)
+		*value = w.value;
+	return w.done;
+}
+
+bool tc_chan_send(tc_channel_t* c, void* value)
+{
+	if (c->mode != CHANNEL_LOCKED)
+		return channel_lf_send(c, value);
+	TC_LOCK(&c->lock);
+	if (c->closed) {
+		TC_UNLOCK(&c->lock);
+		return false;
+	}
+	fiber_t* f;
+	if (channel_writable(c) && channel_give(c, value, &f)) {
+		TC_UNLOCK(&c->lock);
+		if (f)
+			fiber_handoff(f);
+		return true;
+	}
+	// Sleep until a receiver takes our value or the channel is closed
+	chanwaiter_t w = { 0 };
+	w.fiber = tc_fiber();
+	w.value = value;
+	slist_add_tail(&c->producers, (lifo_t*)&w);
+	tc_fiber_yield(&c->lock);
+	return w.done;
+}
+
+uint32_t tc_chan_send_n(tc_channel_t* c, void* const* values, uint32_t count)
+{
+	uint32_t sent = 0;
+	while (sent < count) {
+		if (c->mode != CHANNEL_LOCKED) {
+			if (c->closed)
+				break;
+			size_t n = c->mode == CHANNEL_SPSC ?
+				spsc_queue_put_n(c->spsc, values + sent, count - sent) :
+				lf_queue_put_n(c->queue, values + sent, count - sent);
+			if (n) {
+				sent += (uint32_t)n;
+				channel_notify(c, &c->consumers, &c->num_consumers, n);
+				continue;
+			}
+		}
+		else {
+			// Move as many values as fit under one lock, waking receivers once we let go of it
+			fiber_t* wake[FIBER_WAKE_BATCH];
+			uint32_t num_wake = 0;
+			TC_LOCK(&c->lock);
+			if (c->closed) {
+				TC_UNLOCK(&c->lock);
+				break;
+			}
+			fiber_t* f;
+			while (sent < count && num_wake < FIBER_WAKE_BATCH && channel_writable(c) && channel_give(c, values[sent], &f)) {
+				sent++;
+				if (f)
+					wake[num_wake++] = f;
+			}
+			bool progress = sent == count || num_wake == FIBER_WAKE_BATCH;
+			TC_UNLOCK(&c->lock);
+			for (uint32_t i = 0; i < num_wake; i++)
+				fiber_handoff(wake[i]);
+			if (progress)
+				continue;
+		}
+		// Channel is full, wait until the next value fits
+		if (!tc_chan_send(c, values[sent]))
+			break;
+		sent++;
+	}
+	return sent;
+}
+
+uint32_t tc_chan_recv_n(tc_channel_t* c, void** values, uint32_t count)
+{
+	// Wait for the first value only, then take whatever else is there
+	if (count == 0 || !tc_chan_recv(c, &values[0]))
+		return 0;
+	uint32_t received = 1;
+	if (c->mode != CHANNEL_LOCKED) {
+		size_t n = c->mode == CHANNEL_SPSC ?
+			spsc_queue_get_n(c->spsc, values + 1, count - 1) :
+			lf_queue_get_n(c->queue, values + 1, count - 1);
+		if (n)
+			channel_notify(c, &c->producers, &c->num_producers, n);
+		return received + (uint32_t)n;
+	}
+	fiber_t* wake[FIBER_WAKE_BATCH];
+	uint32_t num_wake = 0;
+	TC_LOCK(&c->lock);
+	while (received < count && num_wake < FIBER_WAKE_BATCH && channel_readable(c)) {
+		fiber_t* f = channel_take(c, &values[received++]);
+		if (f)
+			wake[num_wake++] = f;
+	}
+	TC_UNLOCK(&c->lock);
+	for (uint32_t i = 0; i < num_wake; i++)
+		fiber_handoff(wake[i]);
+	return received;
+}
+
+static int64_t _channel_get(void* arg)
+{
+	void* value = NULL;
+	tc_chan_recv(arg, &value);
+	return (int64_t)value;
+}
+
+fut_t* tc_chan_get(tc_channel_t* channel)
+{
+	return tc_run_jobs(&(jobdecl_t) { .func = _channel_get, .data = channel }, 1, NULL);
+}
+
+bool tc_chan_try_get(tc_channel_t* c, void** value)
+{
+	if (c->mode != CHANNEL_LOCKED) {
+		if (!channel_lf_get(c, value))
+			return false;
+		channel_notify(c, &c->producers, &c->num_producers, 1);
+		return true;
+	}
+	TC_LOCK(&c->lock);
+	if (!channel_readable(c)) {
+		TC_UNLOCK(&c->lock);
+		return false;
+	}
+	fiber_t* f = channel_take(c, value);
+	TC_UNLOCK(&c->lock);
+	if (f)
+		fiber_handoff(f);
+	return true;
+}
+
+static int64_t _channel_put(void* arg)
+{
+	tc_put_t* put_data = arg;
+	return tc_chan_send(put_data->channel, put_data->value);
+}
+
+fut_t* tc_chan_put(tc_put_t* put_data)
+{
+	return tc_run_jobs(&(jobdecl_t) { .func = _channel_put, .data = put_data }, 1, NULL);
+}
+
+bool tc_chan_try_put(tc_put_t* put_data)
+{
+	tc_channel_t* c = put_data->channel;
+	if (c->mode != CHANNEL_LOCKED) {
+		if (c->closed || !channel_lf_put(c, put_data->value))
+			return false;
+		channel_notify(c, &c->consumers, &c->num_consumers, 1);
+		return true;
+	}
+	TC_LOCK(&c->lock);
+	fiber_t* f;
+	if (c->closed || !channel_writable(c) || !channel_give(c, put_data->value, &f)) {
+		TC_UNLOCK(&c->lock);
+		return false;
+	}
+	TC_UNLOCK(&c->lock);
+	if (f)
+		fiber_handoff(f);
+	return true;
+}
+
+tc_channel_t* tc_chan_new(tc_allocator_i* a, uint32_t num_slots, channelmode_t mode)
+{
+	// Lock free modes keep their values in a separate power of two sized ring
+	uint32_t cap = mode == CHANNEL_LOCKED ? num_slots : 0;
+	tc_channel_t* c = TC_ALLOC(a, sizeof(tc_channel_t) + cap * sizeof(void*));
+	memset(c, 0, sizeof(tc_channel_t) + cap * sizeof(void*));
+	c->base = a;
+	c->mode = mode;
+	c->cap = cap;
+	spin_lock_init(&c->lock);
+	slist_init(&c->consumers);
+	slist_init(&c->producers);
+	uint32_t size = next_power_of_2(num_slots < 2 ? 2 : num_slots);
+	if (mode == CHANNEL_MPMC)
+		c->queue = lf_queue_init(size, a);
+	else if (mode == CHANNEL_SPSC)
+		c->spsc = spsc_queue_init(size, a);
+	return c;
+}
+
+int tc_chan_select(tc_channel_t** channels, uint32_t count, void** value)
+{
+	TC_ASSERT(count > 0 && count <= FIBER_WAIT_ANY_MAX);
+	// Small fiber stacks cannot fit waiters for every channel
+	chanwaiter_t inline_waiters[FIBER_WAIT_ANY_INLINE];
+	chanwaiter_t* waiters = count <= FIBER_WAIT_ANY_INLINE ? inline_waiters : TC_ALLOC(context->a, count * sizeof(chanwaiter_t));
+	// Channel that woke us is tried first so its wakeup is not spent on another channel
+	uint32_t first = 0;
+	int result = -1;
+	while (result < 0) {
+		uint32_t num_closed = 0;
+		uint64_t closed = 0;
+		for (uint32_t j = 0; j < count; j++) {
+			uint32_t i = (first + j) % count;
+			if (tc_chan_try_get(channels[i], value)) {
+				result = i;
+				break;
+			}
+			if (channels[i]->closed) {
+				closed |= (uint64_t)1 << i;
+				num_closed++;
+			}
+		}
+		if (result >= 0 || num_closed == count)
+			break;
+		waitany_t any = { 0 };
+		atomic_init(&any.claim, WAITANY_BUSY);
+		any.fiber = tc_fiber();
+		spin_lock_init(&any.lock);
+		uint32_t num_waiting = 0;
+		for (; num_waiting < count; num_waiting++) {
+			tc_channel_t* c = channels[num_waiting];
+			chanwaiter_t* w = &waiters[num_waiting];
+			memset(w, 0, sizeof(chanwaiter_t));
+			w->fiber = any.fiber;
+			w->index = num_waiting;
+			TC_LOCK(&c->lock);
+			bool ready;
+			if (c->closed) {
+				// Closed channels never wake us, they only count towards all being closed.
+				// A channel that closed after we counted is ready so we count again
+				ready = !(closed & ((uint64_t)1 << num_waiting));
+			}
+			else if (c->mode == CHANNEL_LOCKED) {
+				// Only wait on channels that have nothing, senders take any receiver in the list as room for their value
+				ready = channel_readable(c);
+				if (!ready) {
+					w->any = &any;
+					slist_add_tail(&c->consumers, (lifo_t*)w);
+				}
+			}
+			else {
+				w->any = &any;
+				slist_add_tail(&c->consumers, (lifo_t*)w);
+				atomic_fetch_add(&c->num_consumers, 1);
+				atomic_thread_fence(memory_order_seq_cst);
+				ready = !channel_lf_empty(c);
+			}
+			TC_UNLOCK(&c->lock);
+			if (ready) {
+				waitany_claim_self(&any, num_waiting);
+				num_waiting++;
+				break;
+			}
+		}
+		uint32_t index = waitany_sleep(&any);
+		// Leave the wait lists we are still in, a locked channel could have handed us a value already
+		for (uint32_t i = 0; i < num_waiting; i++) {
+			tc_channel_t* c = channels[i];
+			// Not in the wait list of this channel
+			if (!waiters[i].any)
+				continue;
+			TC_LOCK(&c->lock);
+			bool removed = channel_remove(&c->consumers, (lifo_t*)&waiters[i]);
+			if (removed && c->mode != CHANNEL_LOCKED)
+				atomic_fetch_sub(&c->num_consumers, 1);
+			TC_UNLOCK(&c->lock);
+			// A sender on a lock free channel woke us after another channel claimed the select, pass it on
+			if (!removed && i != index && c->mode != CHANNEL_LOCKED)
+				channel_notify(c, &c->consumers, &c->num_consumers, 1);
+		}
+		if (waiters[index].done) {
+			*value = waiters[index].value;
+			result = index;
+		}
+		first = index;
+	}
+	if (waiters != inline_waiters)
+		TC_FREE(context->a, waiters, count * sizeof(chanwaiter_t));
+	return result;
+}
+
+void tc_chan_close(tc_channel_t* c)
+{
+	TC_LOCK(&c->lock);
+	if (!c->closed) {
+		c->closed = true;
+		queue_notify_all(&c->producers);
+		queue_notify_all(&c->consumers);
+		atomic_store(&c->num_producers, 0);
+		atomic_store(&c->num_consumers, 0);
+	}
+	TC_UNLOCK(&c->lock);
+}
+
+void tc_chan_destroy(tc_channel_t* c)
+{
+	if (c->queue)
+		lf_queue_destroy(c->queue);
+	if (c->spsc)
+		spsc_queue_destroy(c->spsc);
 	TC_FREE(c->base, c, sizeof(tc_channel_t) + c->cap * sizeof(void*));
 }
+
+
+/*==========================================================*/
+/*						SYNCHRONIZATION						*/
+/*==========================================================*/
+
+enum {
+	RWLOCK_WRITER = (size_t)1 << (sizeof(size_t) * 8 - 1),		// Set while a writer holds the lock
+	RWLOCK_WAITING = (size_t)1 << (sizeof(size_t) * 8 - 2),		// Set while fibers are in one of the wait lists
+	RWLOCK_READERS = RWLOCK_WAITING - 1,						// Number of readers holding the lock
+};
+
+struct tc_syncwaiter_s {
+	tc_syncwaiter_t* next;
+	fiber_t* fiber;
+};
+
+static void waitlist_push(tc_waitlist_t* list, tc_syncwaiter_t* w)
+{
+	w->next = NULL;
+	if (list->tail)
+		list->tail->next = w;
+	else
+		list->head = w;
+	list->tail = w;
+}
+
+static fiber_t* waitlist_pop(tc_waitlist_t* list)
+{
+	tc_syncwaiter_t* w = list->head;
+	if (!w)
+		return NULL;
+	list->head = w->next;
+	if (!list->head)
+		list->tail = NULL;
+	return w->fiber;
+}
+
+/** Puts the current fiber in the wait list and yields, the guard is released once we switched out */
+static void waitlist_sleep(tc_waitlist_t* list, lock_t* guard)
+{
+	tc_syncwaiter_t w = { NULL, tc_fiber() };
+	waitlist_push(list, &w);
+	tc_fiber_yield(guard);
+}
+
+void tc_mutex_init(tc_mutex_t* m)
+{
+	memset(m, 0, sizeof(tc_mutex_t));
+	spin_lock_init(&m->guard);
+}
+
+bool tc_mutex_try_lock(tc_mutex_t* m)
+{
+	size_t expected = 0;
+	return atomic_compare_exchange_strong(&m->state, &expected, 1);
+}
+
+void tc_mutex_lock(tc_mutex_t* m)
+{
+	for (uint32_t i = 0; i < FIBER_SYNC_SPIN; i++) {
+		if (atomic_load_explicit(&m->state, memory_order_relaxed) == 0 && tc_mutex_try_lock(m))
+			return;
+		pause();
+	}
+	TC_LOCK(&m->guard);
+	size_t state = atomic_load(&m->state);
+	for (;;) {
+		if (state == 0) {
+			if (atomic_compare_exchange_weak(&m->state, &state, 1)) {
+				TC_UNLOCK(&m->guard);
+				return;
+			}
+		}
+		// Tell the holder to look at the wait list when it unlocks
+		else if (atomic_compare_exchange_weak(&m->state, &state, 2))
+			break;
+	}
+	// The lock is handed to us when we are woken up
+	waitlist_sleep(&m->waiters, &m->guard);
+}
+
+void tc_mutex_unlock(tc_mutex_t* m)
+{
+	size_t expected = 1;
+	if (atomic_compare_exchange_strong(&m->state, &expected, 0))
+		return;
+	TC_ASSERT(expected == 2);
+	TC_LOCK(&m->guard);
+	fiber_t* f = waitlist_pop(&m->waiters);
+	TC_ASSERT(f);
+	// Stays locked for the fiber we hand it to
+	if (!m->waiters.head)
+		atomic_store(&m->state, 1);
+	TC_UNLOCK(&m->guard);
+	fiber_handoff(f);
+}
+
+void tc_rwlock_init(tc_rwlock_t* rw)
+{
+	memset(rw, 0, sizeof(tc_rwlock_t));
+	spin_lock_init(&rw->guard);
+}
+
+/** Hands the lock to waiting fibers once it is free, called with the guard held */
+static void rwlock_wake(tc_rwlock_t* rw)
+{
+	fiber_t* wake[FIBER_WAKE_BATCH];
+	uint32_t num_wake = 0;
+	size_t state = atomic_load(&rw->state);
+	if (state & (RWLOCK_WRITER | RWLOCK_READERS)) {
+		TC_UNLOCK(&rw->guard);
+		return;
+	}
+	// Writers go first, all readers that were waiting get the lock together after that
+	fiber_t* f = waitlist_pop(&rw->writers);
+	if (f) {
+		wake[num_wake++] = f;
+		state = RWLOCK_WRITER;
+	}
+	else {
+		state = 0;
+		while (num_wake < FIBER_WAKE_BATCH && (f = waitlist_pop(&rw->readers))) {
+			wake[num_wake++] = f;
+			state++;
+		}
+	}
+	if (rw->writers.head || rw->readers.head)
+		state |= RWLOCK_WAITING;
+	atomic_store(&rw->state, state);
+	TC_UNLOCK(&rw->guard);
+	for (uint32_t i = 0; i < num_wake; i++)
+		fiber_handoff(wake[i]);
+}
+
+/** Waits in one of the wait lists until the lock is handed over, unless it can be taken right away */
+static void rwlock_wait(tc_rwlock_t* rw, bool writer)
+{
+	TC_LOCK(&rw->guard);
+	size_t state = atomic_load(&rw->state);
+	for (;;) {
+		bool free = writer ? (state & ~RWLOCK_WAITING) == 0 && !rw->writers.head && !rw->readers.head :
+			!(state & (RWLOCK_WRITER | RWLOCK_WAITING));
+		if (free) {
+			if (atomic_compare_exchange_weak(&rw->state, &state, writer ? state | RWLOCK_WRITER : state + 1)) {
+				TC_UNLOCK(&rw->guard);
+				return;
+			}
+		}
+		else if (atomic_compare_exchange_weak(&rw->state, &state, state | RWLOCK_WAITING))
+			break;
+	}
+	waitlist_sleep(writer ? &rw->writers : &rw->readers, &rw->guard);
+}
+
+void tc_rwlock_read_lock(tc_rwlock_t* rw)
+{
+	for (uint32_t i = 0; i < FIBER_SYNC_SPIN; i++) {
+		size_t state = atomic_load_explicit(&rw->state, memory_order_relaxed);
+		if (!(state & (RWLOCK_WRITER | RWLOCK_WAITING)) &&
+			atomic_compare_exchange_weak(&rw->state, &state, state + 1))
+			return;
+		pause();
+	}
+	rwlock_wait(rw, false);
+}
+
+void tc_rwlock_read_unlock(tc_rwlock_t* rw)
+{
+	size_t state = atomic_fetch_sub(&rw->state, 1) - 1;
+	TC_ASSERT(((state + 1) & RWLOCK_READERS) != 0);
+	// Last reader out wakes up the waiting fibers
+	if ((state & RWLOCK_WAITING) && (state & RWLOCK_READERS) == 0) {
+		TC_LOCK(&rw->guard);
+		rwlock_wake(rw);
+	}
+}
+
+void tc_rwlock_write_lock(tc_rwlock_t* rw)
+{
+	for (uint32_t i = 0; i < FIBER_SYNC_SPIN; i++) {
+		size_t expected = 0;
+		if (atomic_load_explicit(&rw->state, memory_order_relaxed) == 0 &&
+			atomic_compare_exchange_weak(&rw->state, &expected, RWLOCK_WRITER))
+			return;
+		pause();
+	}
+	rwlock_wait(rw, true);
+}
+
+void tc_rwlock_write_unlock(tc_rwlock_t* rw)
+{
+	size_t expected = RWLOCK_WRITER;
+	if (atomic_compare_exchange_strong(&rw->state, &expected, 0))
+		return;
+	TC_LOCK(&rw->guard);
+	atomic_fetch_and(&rw->state, ~(size_t)RWLOCK_WRITER);
+	rwlock_wake(rw);
+}
+
+void tc_sem_init(tc_sem_t* s, size_t count)
+{
+	memset(s, 0, sizeof(tc_sem_t));
+	spin_lock_init(&s->guard);
+	atomic_store(&s->count, count);
+}
+
+static bool sem_try_take(tc_sem_t* s)
+{
+	size_t count = atomic_load_explicit(&s->count, memory_order_relaxed);
+	while (count > 0) {
+		if (atomic_compare_exchange_weak(&s->count, &count, count - 1))
+			return true;
+	}
+	return false;
+}
+
+void tc_sem_wait(tc_sem_t* s)
+{
+	for (uint32_t i = 0; i < FIBER_SYNC_SPIN; i++) {
+		if (sem_try_take(s))
+			return;
+		pause();
+	}
+	TC_LOCK(&s->guard);
+	atomic_fetch_add(&s->num_waiting, 1);
+	// Pairs with the fence in tc_sem_post so either we see the count or the poster sees us
+	atomic_thread_fence(memory_order_seq_cst);
+	if (sem_try_take(s)) {
+		atomic_fetch_sub(&s->num_waiting, 1);
+		TC_UNLOCK(&s->guard);
+		return;
+	}
+	// The poster takes the count for us before waking us up
+	waitlist_sleep(&s->waiters, &s->guard);
+}
+
+void tc_sem_post(tc_sem_t* s)
+{
+	atomic_fetch_add(&s->count, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&s->num_waiting, memory_order_relaxed) == 0)
+		return;
+	fiber_t* f = NULL;
+	TC_LOCK(&s->guard);
+	if (s->waiters.head && sem_try_take(s)) {
+		f = waitlist_pop(&s->waiters);
+		atomic_fetch_sub(&s->num_waiting, 1);
+	}
+	TC_UNLOCK(&s->guard);
+	if (f)
+		fiber_handoff(f);
+}
+
+void tc_cond_init(tc_cond_t* c)
+{
+	memset(c, 0, sizeof(tc_cond_t));
+	spin_lock_init(&c->guard);
+}
+
+void tc_cond_wait(tc_cond_t* c, tc_mutex_t* m)
+{
+	// Holding the guard while unlocking makes sure no signal gets lost before we sleep
+	TC_LOCK(&c->guard);
+	fiber_t* f = tc_fiber();
+	f->blocking = true;
+	tc_mutex_unlock(m);
+	f->blocking = false;
+	waitlist_sleep(&c->waiters, &c->guard);
+	tc_mutex_lock(m);
+}
+
+void tc_cond_signal(tc_cond_t* c)
+{
+	TC_LOCK(&c->guard);
+	fiber_t* f = waitlist_pop(&c->waiters);
+	TC_UNLOCK(&c->guard);
+	if (f)
+		fiber_handoff(f);
+}
+
+void tc_cond_broadcast(tc_cond_t* c)
+{
+	TC_LOCK(&c->guard);
+	tc_syncwaiter_t* w = c->waiters.head;
+	c->waiters.head = c->waiters.tail = NULL;
+	TC_UNLOCK(&c->guard);
+	while (w) {
+		// The waiter can be gone as soon as it is resumed
+		tc_syncwaiter_t* next = w->next;
+		fiber_handoff(w->fiber);
+		w = next;
+	}
+}
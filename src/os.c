@@ -23,10 +23,13 @@ void* os_reserve(size_t size) {
 #ifdef _WIN32
 	return VirtualAlloc(0, size, MEM_RESERVE, PAGE_READWRITE);
 #else
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
 #if defined(MAP_ANON)
-	return mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	return mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
 #else
-	return mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
 #endif
 #endif
 }
@@ -37,6 +40,14 @@ void os_commit(void* ptr, size_t size) {
 #endif
 }
 
+void os_decommit(void* ptr, size_t size) {
+#ifdef _WIN32
+	VirtualFree(ptr, size, MEM_DECOMMIT);
+#else
+	madvise(ptr, size, MADV_DONTNEED);
+#endif
+}
+
 void os_unmap(void* ptr, size_t size) {
 #ifdef _WIN32
 	(void)size;
@@ -62,7 +73,7 @@ void os_guard_page(void* ptr, size_t size) {
 	if (VirtualProtect(ptr, size, PAGE_READWRITE | PAGE_GUARD, &old_options) == 0)
 		abort();
 #else
-	mprotect(ptr, size, PROT_NONE)
+	mprotect(ptr, size, PROT_NONE);
 #endif
 }
 
@@ -205,7 +216,7 @@ os_request_t* os_request_init_ex(char* buf, uint64_t size, tc_allocator_i* temp)
 	TC_UNLOCK(&context->lock);
 	req->instance = req;
 	req->dtor = os_request_destroy;
-	req->future = tc_fut_new(context->allocator, 1, req, 4);
+	req->future = tc_fut_new(context->allocator, 1, req);
 	req->buf = uv_buf_init(buf, (unsigned int)size);
 	req->temp = temp;
 	req->req.data = req;
@@ -366,6 +377,81 @@ uint32_t os_num_cpus() {
 #endif
 }
 
+#ifdef __linux__
+#include <dirent.h>
+#include <sched.h>
+
+static bool os_read_uint(const char* path, uint32_t* value) {
+	FILE* f = fopen(path, "r");
+	if (!f)
+		return false;
+	bool ok = fscanf(f, "%u", value) == 1;
+	fclose(f);
+	return ok;
+}
+
+static uint32_t os_cpu_node(const char* cpu_path) {
+	// The cpu directory has a nodeN link for the node it belongs to
+	DIR* dir = opendir(cpu_path);
+	uint32_t node = 0;
+	if (!dir)
+		return node;
+	struct dirent* entry;
+	while ((entry = readdir(dir))) {
+		if (strncmp(entry->d_name, "node", 4) == 0 && sscanf(entry->d_name + 4, "%u", &node) == 1)
+			break;
+	}
+	closedir(dir);
+	return node;
+}
+#endif
+
+uint32_t os_cpu_topology(cpuinfo_t* cpus, uint32_t max) {
+	uint32_t n = 0;
+#ifdef __linux__
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	bool has_mask = sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == 0;
+	DIR* dir = opendir("/sys/devices/system/cpu");
+	if (dir) {
+		struct dirent* entry;
+		char path[256];
+		while ((entry = readdir(dir)) && n < max) {
+			uint32_t id;
+			char rest;
+			if (sscanf(entry->d_name, "cpu%u%c", &id, &rest) != 1)
+				continue;
+			// Skip cpus that are offline or that we are not allowed to run on
+			if (has_mask && id < CPU_SETSIZE && !CPU_ISSET(id, &allowed))
+				continue;
+			uint32_t online = 1;
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/online", id);
+			os_read_uint(path, &online);
+			if (!online)
+				continue;
+			cpuinfo_t* cpu = &cpus[n++];
+			cpu->id = id;
+			cpu->core = id;
+			cpu->package = 0;
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/core_id", id);
+			os_read_uint(path, &cpu->core);
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/physical_package_id", id);
+			os_read_uint(path, &cpu->package);
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u", id);
+			cpu->node = os_cpu_node(path);
+		}
+		closedir(dir);
+	}
+#endif
+	if (n == 0) {
+		// No topology information, every cpu is its own core on a single node
+		uint32_t num_cpus = os_num_cpus();
+		for (; n < num_cpus && n < max; n++)
+			cpus[n] = (cpuinfo_t){ n, n, 0, 0 };
+	}
+	return n;
+}
+
 void os_set_thread_affinity(tc_thread_t thread, uint32_t cpu_num) {
 #ifdef _WIN32
 	//DWORD_PTR prev_mask = 
@@ -441,7 +527,7 @@ fut_t* os_system_run(const char* cmd, const char** args, size_t numargs, const c
 	tc_process_t* req = tc_calloc(1, sizeof(tc_process_t));
 	req->instance = req;
 	req->dtor = os_process_destroy;
-	req->future = tc_fut_new(context->allocator, 1, req, 4);
+	req->future = tc_fut_new(context->allocator, 1, req);
 	req->req.data = req;
 
 	const char** pargs = (const char**)tc_malloc((numargs + 2) * sizeof(char*));